@@ -0,0 +1,353 @@
+/*
+ * FogLAMP "Simple Python 3.x" filter zero-copy array datapoints.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <reading.h>
+#include "python_datapoint.h"
+#include "array_view.h"
+
+using namespace std;
+
+/**
+ * The Python object exporting the buffer of a datapoint
+ */
+typedef struct {
+	PyObject_HEAD
+	// The datapoint
+	Datapoint*	dp;
+	// The datapoint belongs to the object
+	bool		owned;
+	// Number of items of the buffer
+	Py_ssize_t	shape;
+} ArrayExporterObject;
+
+static PyTypeObject ArrayExporterType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+};
+
+// Buffer of empty float arrays
+static double emptyArray[1];
+
+/**
+ * Fill in a read-only buffer of the datapoint value: doubles
+ * for a float array, unsigned integers of the item size for a
+ * DataBuffer, or bytes if no integer has this size
+ */
+static int exporterGetBuffer(ArrayExporterObject* self, Py_buffer* view, int flags)
+{
+	DatapointValue& value = self->dp->getData();
+	void* buf;
+	Py_ssize_t itemSize;
+	const char* format;
+	if (value.getType() == DatapointValue::T_FLOAT_ARRAY)
+	{
+		vector<double>* values = value.getDpArr();
+		buf = values->empty() ? emptyArray : values->data();
+		itemSize = sizeof(double);
+		self->shape = values->size();
+		format = "d";
+	}
+	else
+	{
+		DataBuffer* buffer = value.getDataBuffer();
+		buf = buffer->getData();
+		format = PythonDatapoint::bufferFormat(buffer->getItemSize());
+		itemSize = format ? buffer->getItemSize() : 1;
+		self->shape = buffer->getItemSize() * buffer->getItemCount() / itemSize;
+		if (!format)
+		{
+			format = "B";
+		}
+	}
+
+	if (PyBuffer_FillInfo(view, (PyObject *)self, buf,
+			      self->shape * itemSize, 1, flags) < 0)
+	{
+		return -1;
+	}
+	view->itemsize = itemSize;
+	if (flags & PyBUF_FORMAT)
+	{
+		view->format = (char *)format;
+	}
+	if (flags & PyBUF_ND)
+	{
+		view->shape = &self->shape;
+	}
+	return 0;
+}
+
+static void exporterDealloc(ArrayExporterObject* self)
+{
+	if (self->owned)
+	{
+		delete self->dp;
+	}
+	PyObject_Del(self);
+}
+
+static PyBufferProcs exporterBuffer = {
+	(getbufferproc)exporterGetBuffer,
+	NULL
+};
+
+/**
+ * Destructor: release the views left, if any
+ */
+ArrayViews::~ArrayViews()
+{
+	PyGILState_STATE state = PyGILState_Ensure();
+	for (auto it = m_exporters.begin(); it != m_exporters.end(); ++it)
+	{
+		Py_DECREF(*it);
+	}
+	for (auto it = m_retired.begin(); it != m_retired.end(); ++it)
+	{
+		delete *it;
+	}
+	PyGILState_Release(state);
+}
+
+/**
+ * Initialise the Python type exporting the buffers, once
+ *
+ * @return	False if the type cannot be created
+ */
+bool ArrayViews::initialise()
+{
+	if (ArrayExporterType.tp_flags & Py_TPFLAGS_READY)
+	{
+		return true;
+	}
+
+	ArrayExporterType.tp_name = "foglamp_reading.ArrayBuffer";
+	ArrayExporterType.tp_doc = "The storage of an array datapoint";
+	ArrayExporterType.tp_basicsize = sizeof(ArrayExporterObject);
+	ArrayExporterType.tp_flags = Py_TPFLAGS_DEFAULT;
+	ArrayExporterType.tp_dealloc = (destructor)exporterDealloc;
+	ArrayExporterType.tp_as_buffer = &exporterBuffer;
+
+	return PyType_Ready(&ArrayExporterType) == 0;
+}
+
+/**
+ * Check whether a datapoint value is passed as a memoryview
+ *
+ * @param value		The datapoint value
+ * @return		True for float arrays and DataBuffers
+ */
+bool ArrayViews::isArray(DatapointValue& value)
+{
+	return value.getType() == DatapointValue::T_FLOAT_ARRAY ||
+	       value.getType() == DatapointValue::T_DATABUFFER;
+}
+
+/**
+ * Return a dict of datapoints where the memoryviews, and other
+ * objects supporting the buffer protocol such as numpy arrays,
+ * are replaced by lists, for the readings converted by PythonReading
+ *
+ * @param dict		The dict of datapoints
+ * @return		New reference to the dict itself if it has
+ *			no memoryview, or to a new dict; NULL on error
+ */
+PyObject* ArrayViews::toLists(PyObject* dict)
+{
+	PyObject* lists = NULL;
+	PyObject *key, *value;
+	Py_ssize_t pos = 0;
+	while (PyDict_Next(dict, &pos, &key, &value))
+	{
+		if (!PyObject_CheckBuffer(value) || PyBytes_Check(value))
+		{
+			continue;
+		}
+		if (!lists && (lists = PyDict_Copy(dict)) == NULL)
+		{
+			return NULL;
+		}
+		PyObject* view = PyMemoryView_FromObject(value);
+		PyObject* list = view ? PyObject_CallMethod(view, "tolist", NULL) : NULL;
+		Py_XDECREF(view);
+		if (!list || PyDict_SetItem(lists, key, list) < 0)
+		{
+			Py_XDECREF(list);
+			Py_DECREF(lists);
+			return NULL;
+		}
+		Py_DECREF(list);
+	}
+	if (!lists)
+	{
+		Py_INCREF(dict);
+		lists = dict;
+	}
+	return lists;
+}
+
+/**
+ * Convert a datapoint of the current reading into a Python object:
+ * a memoryview of the datapoint storage for arrays, otherwise the
+ * value converted by PythonDatapoint
+ *
+ * @param dp		The datapoint
+ * @param stringKeys	Use str keys for the names in dicts
+ * @return		New reference to the Python object,
+ *			NULL with the Python error set on error
+ */
+PyObject* ArrayViews::toPython(Datapoint* dp, bool stringKeys)
+{
+	if (!isArray(dp->getData()))
+	{
+		return PythonDatapoint::toPython(dp->getData(), stringKeys);
+	}
+
+	// One exporter per datapoint, that may own it
+	for (auto it = m_exporters.begin(); it != m_exporters.end(); ++it)
+	{
+		if (((ArrayExporterObject *)*it)->dp == dp)
+		{
+			return PyMemoryView_FromObject(*it);
+		}
+	}
+
+	ArrayExporterObject* exporter = PyObject_New(ArrayExporterObject, &ArrayExporterType);
+	if (!exporter)
+	{
+		return NULL;
+	}
+	exporter->dp = dp;
+	exporter->owned = false;
+	exporter->shape = 0;
+
+	PyObject* view = PyMemoryView_FromObject((PyObject *)exporter);
+	if (!view)
+	{
+		Py_DECREF(exporter);
+		return NULL;
+	}
+	m_exporters.push_back((PyObject *)exporter);
+	return view;
+}
+
+/**
+ * Check whether a datapoint is viewed
+ */
+bool ArrayViews::isViewed(Datapoint* dp)
+{
+	for (auto it = m_exporters.begin(); it != m_exporters.end(); ++it)
+	{
+		if (((ArrayExporterObject *)*it)->dp == dp)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Set the value of a datapoint of the reading. A viewed datapoint
+ * is replaced by a new one and retired, so that its memory remains.
+ *
+ * @param reading	The reading
+ * @param dp		The datapoint of the reading
+ * @param value		The new value, may be emptied
+ */
+void ArrayViews::setValue(Reading* reading, Datapoint* dp, DatapointValue& value)
+{
+	if (!isViewed(dp))
+	{
+		PythonDatapoint::setValue(dp->getData(), value);
+		return;
+	}
+	vector<Datapoint *>& dps = reading->getReadingData();
+	auto it = find(dps.begin(), dps.end(), dp);
+	if (it != dps.end())
+	{
+		*it = PythonDatapoint::newDatapoint(dp->getName(), value);
+		m_retired.push_back(dp);
+	}
+}
+
+/**
+ * Remove a datapoint from the reading. A viewed datapoint is
+ * retired rather than deleted.
+ *
+ * @param reading	The reading
+ * @param name		The datapoint name
+ */
+void ArrayViews::remove(Reading* reading, const string& name)
+{
+	Datapoint* dp = reading->removeDatapoint(name);
+	if (dp && isViewed(dp))
+	{
+		m_retired.push_back(dp);
+	}
+	else
+	{
+		delete dp;
+	}
+}
+
+/**
+ * Release the views of a reading once the Python code has run
+ * and the objects holding views for the code are released.
+ *
+ * A view still referenced has been kept by the code: its object
+ * takes ownership of the datapoint, which is replaced in the
+ * reading by a copy, or just removed if the reading is deleted.
+ *
+ * @param reading	The reading
+ * @param deleted	True if the reading will be deleted
+ */
+void ArrayViews::release(Reading* reading, bool deleted)
+{
+	for (auto it = m_exporters.begin(); it != m_exporters.end(); ++it)
+	{
+		ArrayExporterObject* exporter = (ArrayExporterObject *)*it;
+		if (Py_REFCNT(exporter) > 1 && !exporter->owned)
+		{
+			auto retired = find(m_retired.begin(), m_retired.end(), exporter->dp);
+			if (retired != m_retired.end())
+			{
+				m_retired.erase(retired);
+				exporter->owned = true;
+			}
+			else
+			{
+				vector<Datapoint *>& dps = reading->getReadingData();
+				auto dp = find(dps.begin(), dps.end(), exporter->dp);
+				if (dp != dps.end())
+				{
+					if (deleted)
+					{
+						dps.erase(dp);
+					}
+					else
+					{
+						*dp = new Datapoint(exporter->dp->getName(),
+								    exporter->dp->getData());
+					}
+					exporter->owned = true;
+				}
+			}
+		}
+		Py_DECREF(exporter);
+	}
+	m_exporters.clear();
+
+	for (auto it = m_retired.begin(); it != m_retired.end(); ++it)
+	{
+		delete *it;
+	}
+	m_retired.clear();
+}
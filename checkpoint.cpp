@@ -0,0 +1,328 @@
+/*
+ * FogLAMP "Simple Python 3.x" filter checkpoints of user_data.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <logger.h>
+#include "checkpoint.h"
+#include "fnv_hash.h"
+
+using namespace std;
+
+// Marks a checkpoint file, along with its version
+#define CHECKPOINT_MAGIC	"FPYUD002"
+#define CHECKPOINT_MAGIC_SIZE	8
+
+/**
+ * Return the path of the checkpoint file of a filter:
+ * $FOGLAMP_DATA/cache/simple-python/<filter name>-<hash>.pickle
+ *
+ * Characters of the name other than letters, digits, '-' and '.' are
+ * replaced by '_': the FNV-1a hash of the name, in hex, keeps apart
+ * the files of names such as "a b" and "a_b".
+ *
+ * @param filterName	The name of the filter
+ * @return		The path of the file
+ */
+string Checkpoint::getPath(const string& filterName)
+{
+	string path;
+	const char* data = getenv("FOGLAMP_DATA");
+	const char* root = getenv("FOGLAMP_ROOT");
+	if (data)
+	{
+		path = data;
+	}
+	else if (root)
+	{
+		path = string(root) + "/data";
+	}
+	else
+	{
+		path = "/usr/local/foglamp/data";
+	}
+	path += "/cache/simple-python/";
+
+	// The filter name may hold any character
+	for (size_t i = 0; i < filterName.length(); i++)
+	{
+		char c = filterName[i];
+		path += isalnum((unsigned char)c) || c == '-' || c == '.' ? c : '_';
+	}
+	char hash[24];
+	snprintf(hash, sizeof(hash), "-%016llx",
+		 (unsigned long long)fnvHash(filterName));
+	return path + hash + ".pickle";
+}
+
+/**
+ * Pickle the user_data dict
+ *
+ * The caller must hold the GIL.
+ *
+ * @param userData	The dict
+ * @return		False with the Python error set on failure
+ */
+bool Checkpoint::take(PyObject* userData)
+{
+	PyObject* pickle = PyImport_ImportModule("pickle");
+	if (!pickle)
+	{
+		return false;
+	}
+
+	PyObject* buffers = PyList_New(0);
+	PyObject* dumps = PyObject_GetAttrString(pickle, "dumps");
+	PyObject* args = PyTuple_Pack(1, userData);
+#if PY_VERSION_HEX >= 0x03080000
+	// Buffers are passed to buffers.append rather than pickled
+	PyObject* append = PyObject_GetAttrString(buffers, "append");
+	PyObject* kwargs = Py_BuildValue("{s:i,s:O}",
+					 "protocol", 5,
+					 "buffer_callback", append);
+	Py_XDECREF(append);
+#else
+	PyObject* kwargs = Py_BuildValue("{s:i}", "protocol", 4);
+#endif
+	PyObject* data = dumps && args && kwargs ?
+			 PyObject_Call(dumps, args, kwargs) :
+			 NULL;
+	Py_XDECREF(kwargs);
+	Py_XDECREF(args);
+	Py_XDECREF(dumps);
+	Py_DECREF(pickle);
+
+	bool ret = data != NULL;
+	if (data)
+	{
+		m_pickle.assign(PyBytes_AS_STRING(data), PyBytes_GET_SIZE(data));
+		Py_DECREF(data);
+	}
+
+	m_buffers.clear();
+	for (Py_ssize_t i = 0; ret && i < PyList_GET_SIZE(buffers); i++)
+	{
+		Py_buffer view;
+		if (PyObject_GetBuffer(PyList_GET_ITEM(buffers, i), &view, PyBUF_CONTIG_RO) < 0)
+		{
+			ret = false;
+			break;
+		}
+		m_buffers.push_back(string((const char *)view.buf, view.len));
+		PyBuffer_Release(&view);
+	}
+	Py_XDECREF(buffers);
+
+	return ret;
+}
+
+/**
+ * Create the directories of a file
+ */
+static void makeDirectories(const string& path)
+{
+	for (size_t pos = path.find('/', 1); pos != string::npos; pos = path.find('/', pos + 1))
+	{
+		mkdir(path.substr(0, pos).c_str(), 0755);
+	}
+}
+
+/**
+ * Write a length followed by the bytes of a block
+ */
+static bool writeBlock(FILE* fp, const string& block)
+{
+	uint64_t length = block.length();
+	return fwrite(&length, sizeof(length), 1, fp) == 1 &&
+	       (!length || fwrite(block.data(), length, 1, fp) == 1);
+}
+
+/**
+ * Write the checkpoint to its file
+ *
+ * The checkpoint is written to a temporary file which then replaces
+ * the file, so that the file always holds a complete checkpoint.
+ * The GIL is not needed.
+ *
+ * @param path	The path of the file
+ * @return	False with errno set on failure
+ */
+bool Checkpoint::write(const string& path) const
+{
+	makeDirectories(path);
+
+	string temporary = path + ".tmp";
+	FILE* fp = fopen(temporary.c_str(), "wb");
+	if (!fp)
+	{
+		return false;
+	}
+
+	uint64_t hash = m_hash;
+	uint32_t count = m_buffers.size();
+	bool ret = fwrite(CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_SIZE, 1, fp) == 1 &&
+		   fwrite(&hash, sizeof(hash), 1, fp) == 1 &&
+		   fwrite(&count, sizeof(count), 1, fp) == 1;
+	for (auto it = m_buffers.begin(); ret && it != m_buffers.end(); ++it)
+	{
+		ret = writeBlock(fp, *it);
+	}
+	ret = ret &&
+	      writeBlock(fp, m_pickle) &&
+	      fflush(fp) == 0 &&
+	      fsync(fileno(fp)) == 0;
+	ret = fclose(fp) == 0 && ret;
+	ret = ret && rename(temporary.c_str(), path.c_str()) == 0;
+
+	if (!ret)
+	{
+		int error = errno;
+		unlink(temporary.c_str());
+		errno = error;
+	}
+	return ret;
+}
+
+/**
+ * Read a length followed by the bytes of a block
+ */
+static bool readBlock(const string& content, size_t& offset, string& block)
+{
+	uint64_t length;
+	if (content.length() - offset < sizeof(length))
+	{
+		return false;
+	}
+	memcpy(&length, content.data() + offset, sizeof(length));
+	offset += sizeof(length);
+	if (content.length() - offset < length)
+	{
+		return false;
+	}
+	block.assign(content, offset, length);
+	offset += length;
+	return true;
+}
+
+/**
+ * Restore the items of a checkpoint into the user_data dict
+ *
+ * The caller must hold the GIL.
+ *
+ * @param path		The path of the checkpoint file
+ * @param hash		The hash of the code of the filter
+ * @param userData	The dict
+ * @return		True if the dict has been restored, false if
+ *			there is no checkpoint for the code or if the
+ *			checkpoint cannot be read
+ */
+bool Checkpoint::restore(const string& path, uint64_t hash, PyObject* userData)
+{
+	FILE* fp = fopen(path.c_str(), "rb");
+	if (!fp)
+	{
+		if (errno != ENOENT)
+		{
+			Logger::getLogger()->warn("Cannot open the checkpoint '%s': %s",
+						  path.c_str(), strerror(errno));
+		}
+		return false;
+	}
+	string content;
+	char chunk[65536];
+	size_t n;
+	while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+	{
+		content.append(chunk, n);
+	}
+	fclose(fp);
+
+	uint64_t fileHash;
+	uint32_t count;
+	size_t offset = CHECKPOINT_MAGIC_SIZE + sizeof(fileHash) + sizeof(count);
+	if (content.length() < offset ||
+	    content.compare(0, CHECKPOINT_MAGIC_SIZE, CHECKPOINT_MAGIC) != 0)
+	{
+		Logger::getLogger()->warn("The checkpoint '%s' is not valid, ignored",
+					  path.c_str());
+		return false;
+	}
+	memcpy(&fileHash, content.data() + CHECKPOINT_MAGIC_SIZE, sizeof(fileHash));
+	memcpy(&count, content.data() + CHECKPOINT_MAGIC_SIZE + sizeof(fileHash), sizeof(count));
+	if (fileHash != hash)
+	{
+		Logger::getLogger()->info("The checkpoint '%s' was taken with another "
+					  "version of the Python code, ignored",
+					  path.c_str());
+		return false;
+	}
+
+	// Buffers are restored as bytearrays, so that arrays are writable
+	PyObject* buffers = PyList_New(0);
+	string block;
+	bool valid = true;
+	for (uint32_t i = 0; valid && i < count; i++)
+	{
+		valid = readBlock(content, offset, block);
+		if (valid)
+		{
+			PyObject* buffer = PyByteArray_FromStringAndSize(block.data(), block.length());
+			PyList_Append(buffers, buffer);
+			Py_XDECREF(buffer);
+		}
+	}
+	valid = valid && readBlock(content, offset, block);
+	if (!valid)
+	{
+		Py_DECREF(buffers);
+		Logger::getLogger()->warn("The checkpoint '%s' is truncated, ignored",
+					  path.c_str());
+		return false;
+	}
+
+	PyObject* restored = NULL;
+	PyObject* pickle = PyImport_ImportModule("pickle");
+	PyObject* loads = pickle ? PyObject_GetAttrString(pickle, "loads") : NULL;
+	PyObject* data = PyBytes_FromStringAndSize(block.data(), block.length());
+	PyObject* args = data ? PyTuple_Pack(1, data) : NULL;
+#if PY_VERSION_HEX >= 0x03080000
+	PyObject* kwargs = Py_BuildValue("{s:O}", "buffers", buffers);
+#else
+	PyObject* kwargs = count ? NULL : PyDict_New();
+#endif
+	if (loads && args && kwargs)
+	{
+		restored = PyObject_Call(loads, args, kwargs);
+	}
+	Py_XDECREF(kwargs);
+	Py_XDECREF(args);
+	Py_XDECREF(data);
+	Py_XDECREF(loads);
+	Py_XDECREF(pickle);
+	Py_DECREF(buffers);
+
+	bool ret = restored && PyDict_Check(restored) && PyDict_Update(userData, restored) == 0;
+	Py_XDECREF(restored);
+	if (!ret)
+	{
+		PyErr_Clear();
+		Logger::getLogger()->warn("The checkpoint '%s' cannot be unpickled, ignored",
+					  path.c_str());
+	}
+	return ret;
+}
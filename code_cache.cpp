@@ -0,0 +1,512 @@
+/*
+ * FogLAMP "Simple Python 3.x" filter compiled code cache.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string>
+#include <logger.h>
+#include <marshal.h>
+#include <version.h>
+#include "code_cache.h"
+#include "fnv_hash.h"
+
+// Cache directory, relative to the FogLAMP data directory
+#define CACHE_DIR	"/cache/simple-python"
+// Format of the cache files and of the analysis they hold, to change
+// along with them
+#define CACHE_FORMAT	"2"
+// Version of the plugin and format the cache files are written with
+#define CACHE_VERSION	VERSION "-" CACHE_FORMAT
+
+/**
+ * Python function that finds the datapoints the code accesses.
+ *
+ * It returns (dynamic, keys): keys are the constant subscripts of
+ * 'reading' in the code, dynamic is True when the code uses 'reading'
+ * in any other way, e.g. iterates it, or may access local variables
+ * by name.
+ */
+static const char* analyseSource =
+"import ast\n"
+"def analyse(source):\n"
+"    tree = ast.parse(source)\n"
+"    parents = {}\n"
+"    for node in ast.walk(tree):\n"
+"        for child in ast.iter_child_nodes(node):\n"
+"            parents[child] = node\n"
+"    keys = []\n"
+"    for node in ast.walk(tree):\n"
+"        if not isinstance(node, ast.Name):\n"
+"            continue\n"
+"        if node.id in ('locals', 'vars', 'exec', 'eval'):\n"
+"            return (True, ())\n"
+"        if node.id != 'reading':\n"
+"            continue\n"
+"        parent = parents.get(node)\n"
+"        if not isinstance(parent, ast.Subscript) or \\\n"
+"           parent.value is not node or \\\n"
+"           not isinstance(node.ctx, ast.Load):\n"
+"            return (True, ())\n"
+"        key = parent.slice\n"
+"        if type(key).__name__ == 'Index':\n"
+"            key = key.value\n"
+"        if type(key).__name__ == 'Constant':\n"
+"            value = key.value\n"
+"        elif type(key).__name__ in ('Bytes', 'Str'):\n"
+"            value = key.s\n"
+"        else:\n"
+"            return (True, ())\n"
+"        if not isinstance(value, (bytes, str)):\n"
+"            return (True, ())\n"
+"        if value not in keys:\n"
+"            keys.append(value)\n"
+"    return (False, tuple(keys))\n";
+
+using namespace std;
+
+CodeCache* CodeCache::m_instance = NULL;
+PyObject* CodeCache::m_analyse = NULL;
+
+/**
+ * Destructor: remove the code object
+ *
+ * The last reference may be released by any thread, the GIL
+ * is taken if not already held.
+ */
+CachedCode::~CachedCode()
+{
+	PyGILState_STATE state = PyGILState_Ensure();
+	Py_CLEAR(m_code);
+	Py_CLEAR(m_keys);
+	PyGILState_Release(state);
+}
+
+/**
+ * Constructor from the compiled code tuple
+ *
+ * @param source	The code as found in the configuration item
+ * @param compiled	The (code, dynamic, keys) tuple returned by
+ *			CodeCache::compileSource(), the reference
+ *			is stolen
+ */
+CachedCode::CachedCode(const string& source, PyObject* compiled) :
+		       m_source(source),
+		       m_bytesKeys(false),
+		       m_stringKeys(false)
+{
+	m_code = PyTuple_GET_ITEM(compiled, 0);
+	m_dynamic = PyObject_IsTrue(PyTuple_GET_ITEM(compiled, 1)) == 1;
+	Py_INCREF(m_code);
+
+	PyObject* keys = PyTuple_GET_ITEM(compiled, 2);
+	m_keys = PyTuple_New(PyTuple_GET_SIZE(keys));
+	for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(keys); i++)
+	{
+		PyObject* key = PyTuple_GET_ITEM(keys, i);
+		Py_INCREF(key);
+		if (PyBytes_Check(key))
+		{
+			m_bytesKeys = true;
+			m_datapoints.push_back(string(PyBytes_AS_STRING(key),
+						      PyBytes_GET_SIZE(key)));
+		}
+		else
+		{
+			// Same key object as the constant in the code
+			PyUnicode_InternInPlace(&key);
+			m_stringKeys = true;
+			m_datapoints.push_back(PyUnicode_AsUTF8(key));
+		}
+		PyTuple_SET_ITEM(m_keys, i, key);
+	}
+
+	Py_DECREF(compiled);
+}
+
+/**
+ * Check whether the datapoints the code accesses are unknown,
+ * in which case the whole reading is passed to the code.
+ *
+ * Keys of the other type than the datapoint names passed to the
+ * code never match a datapoint, these are handled by the view.
+ *
+ * @param stringKeys	Datapoint names are passed as str keys
+ * @return		True if the datapoints accessed are not known
+ */
+bool CachedCode::isDynamic(bool stringKeys) const
+{
+	return m_dynamic || (stringKeys ? m_bytesKeys : m_stringKeys);
+}
+
+/**
+ * Return the process-wide code cache
+ */
+CodeCache* CodeCache::getInstance()
+{
+	static mutex instanceMutex;
+	lock_guard<mutex> guard(instanceMutex);
+	if (!m_instance)
+	{
+		m_instance = new CodeCache();
+	}
+	return m_instance;
+}
+
+/**
+ * Return the compiled code for a code configuration item,
+ * compiling it only if no filter has the same code already.
+ *
+ * The caller must hold the GIL.
+ *
+ * @param source	The Python code
+ * @param name		The name reported in Python tracebacks
+ * @return		The compiled code, empty with the Python
+ *			error set if the code cannot be compiled
+ */
+shared_ptr<CachedCode> CodeCache::compile(const string& source,
+					   const char* name)
+{
+	string keyString = name;
+	keyString += '\0';
+	keyString += source;
+	CacheKey key(fnvHash(keyString), PY_VERSION_HEX);
+
+	shared_ptr<CachedCode> cached;
+
+	{
+		lock_guard<mutex> guard(m_mutex);
+		auto it = m_cache.find(key);
+		if (it != m_cache.end())
+		{
+			cached = it->second.lock();
+		}
+	}
+
+	if (cached && cached->getSource() == source)
+	{
+		return cached;
+	}
+
+	// Compile without the cache lock: the compilation may let
+	// another thread take the GIL and look up the cache
+	string cacheFile = getCacheFile(key.first);
+	PyObject* compiled = loadCode(cacheFile, source);
+	if (!compiled)
+	{
+		compiled = compileSource(source, name);
+		if (!compiled)
+		{
+			return shared_ptr<CachedCode>();
+		}
+		saveCode(cacheFile, source, compiled);
+	}
+	cached.reset(new CachedCode(source, compiled));
+
+	lock_guard<mutex> guard(m_mutex);
+	// Remove entries no longer in use
+	for (auto it = m_cache.begin(); it != m_cache.end(); )
+	{
+		if (it->second.expired())
+		{
+			it = m_cache.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+	m_cache[key] = cached;
+
+	return cached;
+}
+
+/**
+ * Compile Python code into a code object and find the datapoints
+ * of the reading the code accesses.
+ *
+ * The code can be either plain Python statements or a Python
+ * string literal holding the statements, which is the form
+ * that used to be passed to exec().
+ *
+ * @param source	The Python code
+ * @param name		The name reported in Python tracebacks
+ * @return		New reference to a (code, dynamic, keys) tuple,
+ *			NULL on error
+ */
+PyObject* CodeCache::compileSource(const string& source,
+				   const char* name)
+{
+	string code = source;
+
+	// Unquote a string literal with ast.literal_eval(), which does
+	// not execute any code
+	PyObject* ast = PyImport_ImportModule("ast");
+	PyObject* literal = ast ?
+			    PyObject_CallMethod(ast, "literal_eval", "s", source.c_str()) :
+			    NULL;
+	if (literal && PyUnicode_Check(literal))
+	{
+		code = PyUnicode_AsUTF8(literal);
+	}
+	// Not a literal: use the code as is
+	PyErr_Clear();
+	Py_CLEAR(literal);
+	Py_CLEAR(ast);
+
+	PyObject* compiled = Py_CompileString(code.c_str(), name, Py_file_input);
+	if (!compiled)
+	{
+		return NULL;
+	}
+
+	PyObject* analysis = analyse(code);
+	if (!analysis)
+	{
+		// Without analysis the code is handled as dynamic
+		PyErr_Clear();
+		analysis = Py_BuildValue("(O())", Py_True);
+	}
+
+	PyObject* result = Py_BuildValue("(OOO)",
+					 compiled,
+					 PyTuple_GET_ITEM(analysis, 0),
+					 PyTuple_GET_ITEM(analysis, 1));
+	Py_DECREF(compiled);
+	Py_DECREF(analysis);
+
+	return result;
+}
+
+/**
+ * Run the analysis of the datapoints accessed by the code
+ *
+ * @param code		The Python code
+ * @return		New reference to a (dynamic, keys) tuple,
+ *			NULL on error
+ */
+PyObject* CodeCache::analyse(const string& code)
+{
+	if (!m_analyse)
+	{
+		PyObject* globals = PyDict_New();
+		PyDict_SetItemString(globals, "__builtins__", PyEval_GetBuiltins());
+		PyObject* run = PyRun_String(analyseSource, Py_file_input, globals, globals);
+		if (run)
+		{
+			m_analyse = PyDict_GetItemString(globals, "analyse");
+			Py_XINCREF(m_analyse);
+		}
+		Py_XDECREF(run);
+		Py_DECREF(globals);
+		if (!m_analyse)
+		{
+			return NULL;
+		}
+	}
+
+	PyObject* analysis = PyObject_CallFunction(m_analyse, "s", code.c_str());
+	if (analysis &&
+	    (!PyTuple_Check(analysis) || PyTuple_GET_SIZE(analysis) != 2))
+	{
+		Py_CLEAR(analysis);
+	}
+
+	return analysis;
+}
+
+/**
+ * Return the path of the on-disk cache file for a code hash,
+ * creating the cache directory if needed.
+ *
+ * The cache directory is under FOGLAMP_DATA, or FOGLAMP_ROOT/data
+ *
+ * @param hash	The hash of the code
+ * @return	The cache file path, empty if there is no data directory
+ */
+string CodeCache::getCacheFile(uint64_t hash)
+{
+	string dir;
+	if (getenv("FOGLAMP_DATA"))
+	{
+		dir = getenv("FOGLAMP_DATA");
+	}
+	else if (getenv("FOGLAMP_ROOT"))
+	{
+		dir = string(getenv("FOGLAMP_ROOT")) + "/data";
+	}
+	else
+	{
+		return string();
+	}
+
+	// Create each directory of the cache path
+	string path = dir;
+	const char* subdirs[] = { "/cache", "/simple-python" };
+	for (const char* subdir : subdirs)
+	{
+		path += subdir;
+		if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+		{
+			return string();
+		}
+	}
+
+	// Files of other versions are never read
+	char name[40];
+	snprintf(name, sizeof(name), "/%016llx-", (unsigned long long)hash);
+
+	return dir + CACHE_DIR + name + CACHE_VERSION + ".pyc";
+}
+
+/**
+ * Load a compiled code tuple from the on-disk cache.
+ *
+ * The file holds the interpreter magic number, the plugin version
+ * and cache format, the source code and the marshalled (code,
+ * dynamic, keys) tuple. A file written by another Python or plugin
+ * version, in another format or for a different source is ignored.
+ *
+ * @param path		The cache file path
+ * @param source	The Python code the tuple is for
+ * @return		New reference to the tuple or NULL
+ */
+PyObject* CodeCache::loadCode(const string& path, const string& source)
+{
+	if (path.empty())
+	{
+		return NULL;
+	}
+
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)(3 * sizeof(uint64_t)))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	size_t size = st.st_size;
+	void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	PyObject* code = NULL;
+	const char* data = (const char *)map;
+	const string version(CACHE_VERSION);
+	uint64_t magic, versionLength, sourceLength = 0;
+	memcpy(&magic, data, sizeof(magic));
+	memcpy(&versionLength, data + sizeof(magic), sizeof(versionLength));
+	size_t offset = 2 * sizeof(uint64_t);
+	bool sameVersion = versionLength == version.length() &&
+			   offset + versionLength + sizeof(sourceLength) <= size &&
+			   memcmp(data + offset, version.data(), versionLength) == 0;
+	if (sameVersion)
+	{
+		offset += versionLength;
+		memcpy(&sourceLength, data + offset, sizeof(sourceLength));
+		offset += sizeof(sourceLength);
+	}
+
+	if (magic == (uint64_t)PyImport_GetMagicNumber() &&
+	    sameVersion &&
+	    sourceLength == source.length() &&
+	    offset + sourceLength < size &&
+	    memcmp(data + offset, source.data(), sourceLength) == 0)
+	{
+		offset += sourceLength;
+		code = PyMarshal_ReadObjectFromString(data + offset, size - offset);
+		if (code &&
+		    (!PyTuple_Check(code) ||
+		     PyTuple_GET_SIZE(code) != 3 ||
+		     !PyCode_Check(PyTuple_GET_ITEM(code, 0)) ||
+		     !PyTuple_Check(PyTuple_GET_ITEM(code, 2))))
+		{
+			Py_CLEAR(code);
+		}
+		// A damaged file is compiled again
+		PyErr_Clear();
+	}
+
+	munmap(map, size);
+
+	return code;
+}
+
+/**
+ * Write a compiled code tuple to the on-disk cache.
+ *
+ * The file is written aside and renamed, so that other
+ * processes never read a partial file. Errors are ignored
+ * as the cache is only an optimisation.
+ *
+ * @param path		The cache file path
+ * @param source	The Python code the tuple is for
+ * @param code		The (code, dynamic, keys) tuple
+ */
+void CodeCache::saveCode(const string& path,
+			 const string& source,
+			 PyObject* code)
+{
+	if (path.empty())
+	{
+		return;
+	}
+
+	PyObject* marshalled = PyMarshal_WriteObjectToString(code, Py_MARSHAL_VERSION);
+	if (!marshalled)
+	{
+		PyErr_Clear();
+		return;
+	}
+
+	string tmpPath = path + "." + to_string(getpid()) + ".tmp";
+	FILE* fp = fopen(tmpPath.c_str(), "wb");
+	if (fp)
+	{
+		const string version(CACHE_VERSION);
+		uint64_t magic = PyImport_GetMagicNumber();
+		uint64_t versionLength = version.length();
+		uint64_t sourceLength = source.length();
+		bool ok = fwrite(&magic, sizeof(magic), 1, fp) == 1 &&
+			  fwrite(&versionLength, sizeof(versionLength), 1, fp) == 1 &&
+			  fwrite(version.data(), 1, versionLength, fp) == versionLength &&
+			  fwrite(&sourceLength, sizeof(sourceLength), 1, fp) == 1 &&
+			  fwrite(source.data(), 1, sourceLength, fp) == sourceLength &&
+			  fwrite(PyBytes_AS_STRING(marshalled),
+				 1,
+				 PyBytes_GET_SIZE(marshalled),
+				 fp) == (size_t)PyBytes_GET_SIZE(marshalled);
+		ok = (fclose(fp) == 0) && ok;
+
+		if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0)
+		{
+			Logger::getLogger()->debug("Unable to write Python code cache file %s",
+						   path.c_str());
+			unlink(tmpPath.c_str());
+		}
+	}
+
+	Py_CLEAR(marshalled);
+}
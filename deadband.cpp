@@ -0,0 +1,207 @@
+/*
+ * FogLAMP "Simple Python 3.x" filter deadband of datapoint values.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <string>
+#include <vector>
+#include <math.h>
+#include <stdlib.h>
+#include <reading.h>
+#include <Python.h>
+#include "python_datapoint.h"
+#include "deadband.h"
+#include "json_config.h"
+
+using namespace std;
+
+/**
+ * Parse a threshold: a non negative number, or a string
+ * of a non negative number followed by '%'
+ *
+ * @param item		The Python object of the threshold
+ * @param threshold	Set to the threshold value
+ * @param percent	Set to true for a percentage
+ * @return		False if the object is not a valid threshold
+ */
+static bool parseThreshold(PyObject* item, double& threshold, bool& percent)
+{
+	percent = false;
+	if (PyLong_Check(item) || PyFloat_Check(item))
+	{
+		threshold = PyFloat_AsDouble(item);
+	}
+	else if (PyUnicode_Check(item))
+	{
+		const char* text = PyUnicode_AsUTF8(item);
+		char* end = NULL;
+		threshold = text ? strtod(text, &end) : -1.0;
+		percent = end && end != text && end[0] == '%' && end[1] == '\0';
+		if (!percent)
+		{
+			return false;
+		}
+	}
+	else
+	{
+		return false;
+	}
+	return threshold >= 0.0;
+}
+
+/**
+ * Set the deadband configuration, forgetting the last values
+ *
+ * The caller must hold the GIL.
+ *
+ * @param config	The JSON configuration, empty or {} for none
+ * @param drop		Remove readings without significant change
+ *			rather than passing them unchanged
+ * @return		False with a Python error set if the
+ *			configuration is not valid
+ */
+bool Deadband::configure(const string& config, bool drop)
+{
+	m_drop = drop;
+	m_specs.clear();
+	m_assets.clear();
+
+	PyObject* deadband;
+	bool valid = JsonConfig::parse(config, &PyDict_Type, deadband);
+	PyObject *asset, *datapoints;
+	Py_ssize_t pos = 0;
+	while (valid && deadband && PyDict_Next(deadband, &pos, &asset, &datapoints))
+	{
+		const char* assetName = PyUnicode_AsUTF8(asset);
+		valid = assetName && PyDict_Check(datapoints);
+		if (!valid)
+		{
+			break;
+		}
+		vector<Threshold>& thresholds = m_specs[assetName];
+		PyObject *name, *item;
+		Py_ssize_t dpPos = 0;
+		while (valid && PyDict_Next(datapoints, &dpPos, &name, &item))
+		{
+			Threshold threshold;
+			const char* dpName = PyUnicode_AsUTF8(name);
+			valid = dpName &&
+				parseThreshold(item, threshold.m_value, threshold.m_percent);
+			if (valid)
+			{
+				threshold.m_name = dpName;
+				thresholds.push_back(threshold);
+			}
+		}
+	}
+	Py_XDECREF(deadband);
+
+	if (!valid)
+	{
+		m_specs.clear();
+		return JsonConfig::invalid("Deadband must be a JSON object of asset names "
+					   "to objects of datapoint names and thresholds, "
+					   "numbers or percentages such as \"2%\"");
+	}
+	return true;
+}
+
+/**
+ * Return the last values of an asset, created on first use
+ *
+ * @param asset		The asset name
+ * @return		The last values, NULL if the asset has no deadband
+ */
+Deadband::AssetValues* Deadband::getAssetValues(const string& asset)
+{
+	auto found = m_assets.find(asset);
+	if (found != m_assets.end())
+	{
+		return found->second.m_thresholds ? &found->second : NULL;
+	}
+
+	AssetValues& values = m_assets[asset];
+	values.m_thresholds = NULL;
+
+	auto spec = m_specs.find(asset);
+	if (spec == m_specs.end())
+	{
+		spec = m_specs.find("*");
+	}
+	if (spec == m_specs.end() || spec->second.empty())
+	{
+		return NULL;
+	}
+
+	values.m_thresholds = &spec->second;
+	values.m_values.resize(spec->second.size(), 0.0);
+	values.m_valid.resize(spec->second.size(), false);
+	return &values;
+}
+
+/**
+ * Check whether a reading has changed significantly, and if so
+ * keep its values as the reference for the next readings
+ *
+ * Readings of assets without deadband, and readings without any of
+ * the datapoints of the deadband, have always changed, as do the
+ * readings that add a datapoint of the deadband.
+ *
+ * @param reading	The reading
+ * @return		True if the reading is to be processed
+ */
+bool Deadband::hasChanged(Reading* reading)
+{
+	AssetValues* last = getAssetValues(reading->getAssetName());
+	if (!last)
+	{
+		return true;
+	}
+
+	const vector<Threshold>& thresholds = *last->m_thresholds;
+	bool compared = false;
+	bool changed = false;
+	for (size_t i = 0; i < thresholds.size() && !changed; i++)
+	{
+		Datapoint* dp = reading->getDatapoint(thresholds[i].m_name);
+		double value;
+		if (!dp || !PythonDatapoint::toNumber(dp->getData(), value))
+		{
+			continue;
+		}
+		compared = true;
+		if (!last->m_valid[i])
+		{
+			changed = true;
+		}
+		else
+		{
+			double limit = thresholds[i].m_percent ?
+				       fabs(last->m_values[i]) * thresholds[i].m_value / 100.0 :
+				       thresholds[i].m_value;
+			changed = fabs(value - last->m_values[i]) > limit;
+		}
+	}
+
+	if (!compared)
+	{
+		return true;
+	}
+	if (changed)
+	{
+		for (size_t i = 0; i < thresholds.size(); i++)
+		{
+			Datapoint* dp = reading->getDatapoint(thresholds[i].m_name);
+			if (dp && PythonDatapoint::toNumber(dp->getData(), last->m_values[i]))
+			{
+				last->m_valid[i] = true;
+			}
+		}
+	}
+	return changed;
+}
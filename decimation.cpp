@@ -0,0 +1,353 @@
+/*
+ * FogLAMP "Simple Python 3.x" filter decimation of readings.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <string>
+#include <vector>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#include <reading.h>
+#include <Python.h>
+#include "python_datapoint.h"
+#include "decimation.h"
+#include "json_config.h"
+#include "reading_order.h"
+
+using namespace std;
+
+/**
+ * Parse the decimation of an asset
+ *
+ * @param item		The Python dict of the decimation
+ * @param mode		Set to 0 for every, 1 for first, 2 for mean
+ * @param count		Set to the count of every
+ * @param interval	Set to the interval of first and mean, in
+ *			microseconds
+ * @return		False if the dict is not a valid decimation
+ */
+static bool parseSpec(PyObject* item, int& mode, unsigned long& count, long long& interval)
+{
+	if (!PyDict_Check(item))
+	{
+		return false;
+	}
+	PyObject* modeName = PyDict_GetItemString(item, "mode");
+	const char* name = modeName && PyUnicode_Check(modeName) ?
+			   PyUnicode_AsUTF8(modeName) :
+			   NULL;
+	if (!name)
+	{
+		return false;
+	}
+
+	if (strcmp(name, "every") == 0)
+	{
+		PyObject* every = PyDict_GetItemString(item, "count");
+		long n = every && PyLong_Check(every) ? PyLong_AsLong(every) : 0;
+		mode = 0;
+		count = n > 0 ? n : 0;
+		return count > 0;
+	}
+
+	PyObject* seconds = PyDict_GetItemString(item, "interval");
+	double value = seconds && (PyLong_Check(seconds) || PyFloat_Check(seconds)) ?
+		       PyFloat_AsDouble(seconds) :
+		       0.0;
+	interval = value > 0.0 && value < 1e12 ? llround(value * 1e6) : 0;
+	mode = strcmp(name, "first") == 0 ? 1 : strcmp(name, "mean") == 0 ? 2 : -1;
+	return mode > 0 && interval > 0;
+}
+
+/**
+ * Destructor: readings of the current intervals are deleted, flush()
+ * passes them on
+ */
+Decimation::~Decimation()
+{
+	for (auto it = m_assets.begin(); it != m_assets.end(); ++it)
+	{
+		delete it->second.m_pending;
+	}
+}
+
+/**
+ * Set the decimation configuration
+ *
+ * The caller must hold the GIL.
+ *
+ * @param config	The JSON configuration, empty or {} for none
+ * @return		False with a Python error set if the
+ *			configuration is not valid
+ */
+bool Decimation::configure(const string& config)
+{
+	m_specs.clear();
+
+	PyObject* decimation;
+	bool valid = JsonConfig::parse(config, &PyDict_Type, decimation);
+	PyObject *asset, *item;
+	Py_ssize_t pos = 0;
+	while (valid && decimation && PyDict_Next(decimation, &pos, &asset, &item))
+	{
+		const char* assetName = PyUnicode_AsUTF8(asset);
+		int mode = -1;
+		Spec spec;
+		spec.m_count = 0;
+		spec.m_interval = 0;
+		valid = assetName &&
+			parseSpec(item, mode, spec.m_count, spec.m_interval);
+		if (valid)
+		{
+			spec.m_mode = (Mode)mode;
+			m_specs[assetName] = spec;
+		}
+	}
+	Py_XDECREF(decimation);
+
+	if (!valid)
+	{
+		m_specs.clear();
+		return JsonConfig::invalid("Decimation must be a JSON object of asset names "
+					   "to objects with a 'mode', 'every' with a 'count', "
+					   "or 'first' or 'mean' with an 'interval' in seconds");
+	}
+	return true;
+}
+
+/**
+ * Return the decimation state of an asset, created on first use
+ *
+ * @param asset		The asset name
+ * @return		The state, NULL if the asset is not decimated
+ */
+Decimation::AssetState* Decimation::getAssetState(const string& asset)
+{
+	auto found = m_assets.find(asset);
+	if (found != m_assets.end())
+	{
+		return found->second.m_spec ? &found->second : NULL;
+	}
+
+	AssetState& state = m_assets[asset];
+	state.m_spec = NULL;
+	state.m_pending = NULL;
+
+	auto spec = m_specs.find(asset);
+	if (spec == m_specs.end())
+	{
+		spec = m_specs.find("*");
+	}
+	if (spec == m_specs.end())
+	{
+		return NULL;
+	}
+
+	state.m_spec = &spec->second;
+	state.m_last = spec->second.m_mode == EVERY ? 0 : LLONG_MIN;
+	return &state;
+}
+
+/**
+ * Return the mean reading of the current interval of an asset,
+ * with the means of its numeric datapoints
+ *
+ * @param state		The decimation state of the asset
+ * @return		The mean reading, NULL if there is none
+ */
+Reading* Decimation::takeMean(AssetState* state)
+{
+	Reading* mean = state->m_pending;
+	for (auto it = state->m_sums.begin(); it != state->m_sums.end(); ++it)
+	{
+		DatapointValue value(it->second.first / it->second.second);
+		it->first->getData() = value;
+	}
+	state->m_sums.clear();
+	state->m_pending = NULL;
+	return mean;
+}
+
+/**
+ * Check whether the current interval of a mean has elapsed on the
+ * wall clock since its first reading was received
+ *
+ * @param state		The decimation state of the asset
+ * @param now		The current time
+ */
+bool Decimation::isExpired(const AssetState& state, chrono::steady_clock::time_point now) const
+{
+	return state.m_pending &&
+	       now - state.m_opened >= chrono::microseconds(state.m_spec->m_interval);
+}
+
+/**
+ * Check whether the interval of a mean has elapsed on the wall clock,
+ * apply() then passes it on
+ */
+bool Decimation::hasExpired()
+{
+	lock_guard<mutex> guard(m_mutex);
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+	for (auto it = m_assets.begin(); it != m_assets.end(); ++it)
+	{
+		if (isExpired(it->second, now))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Pass on the mean readings of the current intervals. Readings passed
+ * to the decimation afterwards are not decimated.
+ *
+ * @param readings	The readings the mean readings are added to
+ */
+void Decimation::flush(vector<Reading *>& readings)
+{
+	lock_guard<mutex> guard(m_mutex);
+	m_flushed = true;
+	for (auto it = m_assets.begin(); it != m_assets.end(); ++it)
+	{
+		if (it->second.m_pending)
+		{
+			readings.push_back(takeMean(&it->second));
+		}
+	}
+}
+
+/**
+ * Decimate the readings, in place
+ *
+ * Readings that are not kept are deleted. A reading that closes the
+ * interval of a mean takes the place of the mean reading. The means
+ * of intervals elapsed on the wall clock are passed first.
+ *
+ * @param readings	The readings
+ */
+void Decimation::apply(vector<Reading *>& readings)
+{
+	lock_guard<mutex> guard(m_mutex);
+	if (m_flushed)
+	{
+		return;
+	}
+
+	// Close the intervals of the assets that stopped reporting
+	vector<Reading *> expired;
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+	for (auto it = m_assets.begin(); it != m_assets.end(); ++it)
+	{
+		if (isExpired(it->second, now))
+		{
+			expired.push_back(takeMean(&it->second));
+		}
+	}
+
+	size_t kept = 0;
+	for (size_t i = 0; i < readings.size(); i++)
+	{
+		Reading* reading = readings[i];
+		AssetState* state = getAssetState(reading->getAssetName());
+		if (!state)
+		{
+			readings[kept++] = reading;
+			continue;
+		}
+
+		const Spec* spec = state->m_spec;
+		Reading* out = NULL;
+		if (spec->m_mode == EVERY)
+		{
+			if (state->m_last++ % spec->m_count == 0)
+			{
+				out = reading;
+			}
+		}
+		else
+		{
+			long long interval = ReadingOrder::userTimestamp(reading) / spec->m_interval;
+			if (spec->m_mode == FIRST)
+			{
+				if (interval != state->m_last)
+				{
+					out = reading;
+				}
+			}
+			else if (state->m_pending && interval == state->m_last)
+			{
+				// Add the values to the sums of the interval
+				vector<Datapoint *>& datapoints = reading->getReadingData();
+				for (auto dp = datapoints.begin(); dp != datapoints.end(); ++dp)
+				{
+					double value;
+					bool numeric = PythonDatapoint::toNumber((*dp)->getData(), value);
+					bool found = false;
+					for (auto it = state->m_sums.begin();
+					     numeric && it != state->m_sums.end();
+					     ++it)
+					{
+						if (it->first->getName() == (*dp)->getName())
+						{
+							it->second.first += value;
+							it->second.second++;
+							found = true;
+							break;
+						}
+					}
+					if (!found && !state->m_pending->getDatapoint((*dp)->getName()))
+					{
+						// A datapoint the previous readings of the
+						// interval did not have: the mean reading has
+						// the datapoints of all of them
+						Datapoint* added = new Datapoint((*dp)->getName(),
+										 (*dp)->getData());
+						state->m_pending->addDatapoint(added);
+						if (numeric)
+						{
+							state->m_sums.push_back(make_pair(added,
+											  make_pair(value, 1UL)));
+						}
+					}
+				}
+			}
+			else
+			{
+				// A new interval: send the mean of the previous one
+				out = takeMean(state);
+				state->m_pending = reading;
+				state->m_opened = now;
+				vector<Datapoint *>& datapoints = reading->getReadingData();
+				for (auto dp = datapoints.begin(); dp != datapoints.end(); ++dp)
+				{
+					double value;
+					if (PythonDatapoint::toNumber((*dp)->getData(), value))
+					{
+						state->m_sums.push_back(make_pair(*dp, make_pair(value, 1UL)));
+					}
+				}
+				reading = NULL;
+			}
+			state->m_last = interval;
+		}
+
+		if (out)
+		{
+			readings[kept++] = out;
+		}
+		if (reading && reading != out)
+		{
+			delete reading;
+		}
+	}
+	readings.resize(kept);
+	readings.insert(readings.begin(), expired.begin(), expired.end());
+}
@@ -0,0 +1,63 @@
+#ifndef _ARRAY_VIEW_H
+#define _ARRAY_VIEW_H
+/*
+ * FogLAMP "Simple Python 3.x" filter zero-copy array datapoints.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <string>
+#include <vector>
+
+#include <reading.h>
+
+#include <Python.h>
+
+/**
+ * ArrayViews class passes float array and DataBuffer datapoints to
+ * the Python code as read-only memoryviews of the datapoint storage,
+ * rather than converting them into lists.
+ *
+ * The memory belongs to the reading. Datapoints the reading removes
+ * or replaces while they are viewed are retired rather than deleted,
+ * and once the code has run a view the code keeps takes ownership
+ * of its datapoint, which is replaced in the reading by a copy.
+ *
+ * An instance holds the views of one reading at a time. All methods
+ * must be called with the GIL held.
+ */
+class ArrayViews
+{
+	public:
+		ArrayViews() {};
+		~ArrayViews();
+
+		static bool	initialise();
+		static bool	isArray(DatapointValue& value);
+		static PyObject*
+				toLists(PyObject* dict);
+
+		PyObject*	toPython(Datapoint* dp, bool stringKeys);
+		void		setValue(Reading* reading,
+					 Datapoint* dp,
+					 DatapointValue& value);
+		void		remove(Reading* reading,
+				       const std::string& name);
+		void		release(Reading* reading, bool deleted);
+
+	private:
+		bool		isViewed(Datapoint* dp);
+
+	private:
+		// Objects exporting the buffers of the datapoints
+		std::vector<PyObject *>
+				m_exporters;
+		// Viewed datapoints removed from the reading
+		std::vector<Datapoint *>
+				m_retired;
+};
+#endif
@@ -0,0 +1,60 @@
+#ifndef _CHECKPOINT_H
+#define _CHECKPOINT_H
+/*
+ * FogLAMP "Simple Python 3.x" filter checkpoints of user_data.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <Python.h>
+
+/**
+ * A snapshot of the 'user_data' dict of a filter, pickled with
+ * protocol 5 when available: buffers such as arrays are copied as
+ * they are, out of the pickle stream.
+ *
+ * A snapshot is taken with the GIL held, by the thread ingesting the
+ * readings, which it delays for the time of the pickling: the dict
+ * cannot change meanwhile. It is written to its file without the GIL,
+ * by another thread. The file holds the FNV-1a hash of the code
+ * that filled the dict: it is only restored for the same code.
+ *
+ * File layout, in native byte order:
+ *
+ *	magic			8 bytes
+ *	code hash		uint64
+ *	number of buffers	uint32
+ *	buffers			uint64 length and bytes, each
+ *	pickle			uint64 length and bytes
+ */
+class Checkpoint
+{
+	public:
+		Checkpoint(uint64_t hash) : m_hash(hash) {};
+
+		static std::string
+				getPath(const std::string& filterName);
+		bool		take(PyObject* userData);
+		bool		write(const std::string& path) const;
+		static bool	restore(const std::string& path,
+					uint64_t hash,
+					PyObject* userData);
+
+	private:
+		// Hash of the code of the filter
+		uint64_t	m_hash;
+		// Pickled dict
+		std::string	m_pickle;
+		// Out of band buffers of the pickle
+		std::vector<std::string>
+				m_buffers;
+};
+#endif
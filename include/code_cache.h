@@ -0,0 +1,107 @@
+#ifndef _CODE_CACHE_H
+#define _CODE_CACHE_H
+/*
+ * FogLAMP "Simple Python 3.x" filter compiled code cache.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <mutex>
+#include <memory>
+#include <string>
+#include <map>
+#include <vector>
+
+#include <Python.h>
+
+/**
+ * A Python code configuration item compiled into a code object,
+ * along with the datapoints of the reading the code accesses.
+ *
+ * Instances are immutable and shared by all the filters
+ * with identical code.
+ */
+class CachedCode
+{
+	public:
+		CachedCode(const std::string& source, PyObject* compiled);
+		~CachedCode();
+
+		PyObject*	getCode() const { return m_code; };
+		const std::string&
+				getSource() const { return m_source; };
+		bool		isDynamic(bool stringKeys) const;
+		const std::vector<std::string>&
+				getDatapoints() const { return m_datapoints; };
+		PyObject*	getKeys() const { return m_keys; };
+
+	private:
+		// The code as found in the configuration item
+		const std::string
+				m_source;
+		// The compiled code object
+		PyObject*	m_code;
+		// True if the datapoints accessed are not known
+		bool		m_dynamic;
+		// The code uses bytes keys
+		bool		m_bytesKeys;
+		// The code uses str keys
+		bool		m_stringKeys;
+		// Names of the datapoints accessed
+		std::vector<std::string>
+				m_datapoints;
+		// Tuple of the keys of the datapoints accessed
+		PyObject*	m_keys;
+};
+
+/**
+ * CodeCache class is a process-wide cache of compiled code,
+ * keyed by the hash of the code and the Python version.
+ *
+ * Entries are kept while a filter uses them. Compiled code is
+ * also marshalled to a cache directory under FOGLAMP_DATA, so
+ * that filters restart without compiling their code.
+ */
+class CodeCache
+{
+	public:
+		static CodeCache*
+				getInstance();
+		std::shared_ptr<CachedCode>
+				compile(const std::string& source,
+					const char* name);
+
+	private:
+		CodeCache() {};
+		static PyObject*
+				compileSource(const std::string& source,
+					      const char* name);
+		static PyObject*
+				analyse(const std::string& code);
+		static std::string
+				getCacheFile(uint64_t hash);
+		static PyObject*
+				loadCode(const std::string& path,
+					 const std::string& source);
+		static void	saveCode(const std::string& path,
+					 const std::string& source,
+					 PyObject* code);
+
+	private:
+		typedef std::pair<uint64_t, unsigned long>
+				CacheKey;
+
+		static CodeCache*
+				m_instance;
+		// The analysis Python function
+		static PyObject*
+				m_analyse;
+		std::mutex	m_mutex;
+		std::map<CacheKey, std::weak_ptr<CachedCode> >
+				m_cache;
+};
+#endif
@@ -0,0 +1,87 @@
+#ifndef _DEADBAND_H
+#define _DEADBAND_H
+/*
+ * FogLAMP "Simple Python 3.x" filter deadband of datapoint values.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+
+#include <reading.h>
+
+/**
+ * Deadband class finds, before the Python code runs, the readings
+ * whose numeric datapoints have not changed significantly since the
+ * last reading of the same asset that passed the deadband.
+ *
+ * A change is significant when it exceeds the absolute threshold, or
+ * the percentage of the previous value, configured for the datapoint.
+ * Readings without a significant change either pass unchanged without
+ * running the Python code, or are removed.
+ *
+ * The configuration is a JSON object of asset names, or "*" for any
+ * asset, to objects of datapoint names and thresholds: numbers are
+ * absolute thresholds, strings such as "2%" are percentages.
+ *
+ * configure() must be called with the GIL held. The other methods do
+ * not use Python but must be called with the GIL held as well: the
+ * readings of the ingest, release, compile and shutdown threads all
+ * go through the same deadband, and the GIL is its only lock.
+ */
+class Deadband
+{
+	public:
+		Deadband() : m_drop(false) {};
+
+		bool		configure(const std::string& config, bool drop);
+		bool		isEnabled() const { return !m_specs.empty(); };
+		bool		dropsReadings() const { return m_drop; };
+		bool		hasChanged(Reading* reading);
+
+	private:
+		/**
+		 * The threshold of a datapoint
+		 */
+		class Threshold
+		{
+			public:
+				std::string	m_name;
+				double		m_value;
+				bool		m_percent;
+		};
+
+		/**
+		 * The last values passed for an asset, by threshold
+		 */
+		class AssetValues
+		{
+			public:
+				const std::vector<Threshold>*
+						m_thresholds;
+				std::vector<double>
+						m_values;
+				std::vector<bool>
+						m_valid;
+		};
+
+		AssetValues*	getAssetValues(const std::string& asset);
+
+	private:
+		// Thresholds by asset name
+		std::map<std::string, std::vector<Threshold> >
+				m_specs;
+		// Last values by asset name
+		std::unordered_map<std::string, AssetValues>
+				m_assets;
+		// Remove the readings without significant change
+		bool		m_drop;
+};
+#endif
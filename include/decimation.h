@@ -0,0 +1,112 @@
+#ifndef _DECIMATION_H
+#define _DECIMATION_H
+/*
+ * FogLAMP "Simple Python 3.x" filter decimation of readings.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <utility>
+#include <mutex>
+#include <chrono>
+
+#include <reading.h>
+
+/**
+ * Decimation class reduces the readings of high rate assets before
+ * they are converted for the Python code:
+ *
+ *	every	keeps one reading every 'count' readings
+ *	first	keeps the first reading of every 'interval' seconds
+ *	mean	replaces the readings of every 'interval' seconds with
+ *		one reading, the first one, whose numeric datapoints are
+ *		the means of their values in the interval, along with
+ *		the datapoints only later readings of the interval have
+ *
+ * Intervals are aligned on the epoch and use the user timestamps.
+ * A mean reading is sent when the first reading of a later interval
+ * of its asset arrives, or once the interval has elapsed on the wall
+ * clock since its first reading arrived, so that the mean of an asset
+ * that stops reporting is not held forever. flush() sends the means
+ * of the current intervals when the decimation is replaced or the
+ * filter shuts down.
+ *
+ * The configuration is a JSON object of asset names, or "*" for any
+ * asset, to objects with the 'mode' and the 'count' or 'interval'.
+ *
+ * configure() must be called with the GIL held, the other methods
+ * do not use Python and may be called by several threads.
+ */
+class Decimation
+{
+	public:
+		Decimation() : m_flushed(false) {};
+		~Decimation();
+
+		bool		configure(const std::string& config);
+		bool		isEnabled() const { return !m_specs.empty(); };
+		void		apply(std::vector<Reading *>& readings);
+		bool		hasExpired();
+		void		flush(std::vector<Reading *>& readings);
+
+	private:
+		enum Mode { EVERY, FIRST, MEAN };
+
+		/**
+		 * The decimation of an asset
+		 */
+		class Spec
+		{
+			public:
+				Mode		m_mode;
+				unsigned long	m_count;
+				long long	m_interval;
+		};
+
+		/**
+		 * The decimation state of an asset
+		 */
+		class AssetState
+		{
+			public:
+				const Spec*	m_spec;
+				// Readings seen, or interval of the last reading
+				long long	m_last;
+				// Mean reading of the current interval and
+				// the time its first reading was received
+				Reading*	m_pending;
+				std::chrono::steady_clock::time_point
+						m_opened;
+				// Sums and counts of its numeric datapoints
+				std::vector<std::pair<Datapoint *, std::pair<double, unsigned long> > >
+						m_sums;
+		};
+
+		AssetState*	getAssetState(const std::string& asset);
+		bool		keep(AssetState* state, Reading* reading, Reading*& mean);
+		Reading*	takeMean(AssetState* state);
+		bool		isExpired(const AssetState& state,
+					  std::chrono::steady_clock::time_point now) const;
+
+	private:
+		// Serialises the ingest and the release of mean readings
+		std::mutex	m_mutex;
+		// Mean readings have been flushed, readings are now
+		// passed unchanged
+		bool		m_flushed;
+		// Decimation by asset name
+		std::map<std::string, Spec>
+				m_specs;
+		// Decimation state by asset name
+		std::unordered_map<std::string, AssetState>
+				m_assets;
+};
+#endif
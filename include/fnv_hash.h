@@ -0,0 +1,40 @@
+#ifndef _FNV_HASH_H
+#define _FNV_HASH_H
+/*
+ * FogLAMP "Simple Python 3.x" filter FNV-1a hash.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+/**
+ * 64 bit FNV-1a hash of bytes: unlike std::hash, its values do not
+ * depend on the standard library build, so they can be kept in files
+ * and shared memory.
+ *
+ * @param data		The bytes
+ * @param length	The number of bytes
+ * @return		The hash
+ */
+inline uint64_t fnvHash(const char* data, size_t length)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < length; i++)
+	{
+		hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+inline uint64_t fnvHash(const std::string& data)
+{
+	return fnvHash(data.data(), data.length());
+}
+#endif
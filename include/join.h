@@ -0,0 +1,114 @@
+#ifndef _JOIN_H
+#define _JOIN_H
+/*
+ * FogLAMP "Simple Python 3.x" filter join of assets.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <unordered_map>
+#include <utility>
+
+#include <reading.h>
+
+/**
+ * Join class merges the readings of pairs of assets aligned on their
+ * user timestamps, so that the Python code gets one reading with the
+ * datapoints of both, e.g. the voltage and the current of a motor.
+ *
+ * Each reading of the primary asset gets the datapoints of a reading
+ * of the secondary asset within the tolerance of its timestamp:
+ *
+ *	previous	the last secondary reading at or before it,
+ *			the reading is passed on at once
+ *	nearest		the closest secondary reading before or after
+ *			it, the reading is held until a secondary
+ *			reading at or after it arrives, or for the
+ *			tolerance on the wall clock at most
+ *
+ * Secondary readings are held for the primary readings that follow
+ * and are not passed on. Primary readings without a secondary reading
+ * in the tolerance are passed without its datapoints. Readings of
+ * each asset are expected in timestamp order.
+ *
+ * The configuration is a JSON array of objects with the 'primary'
+ * and 'secondary' asset names and optionally the 'tolerance' in
+ * seconds, 1 by default, the 'match', 'nearest' by default, the
+ * 'asset' name of the joined readings and a 'prefix' for the names of
+ * the secondary datapoints.
+ *
+ * Held primary readings are passed on by flush() when the join is
+ * replaced or the filter shuts down.
+ *
+ * configure() must be called with the GIL held, the other methods
+ * do not use Python and may be called by several threads.
+ */
+class Join
+{
+	public:
+		Join() : m_flushed(false) {};
+		~Join();
+
+		bool		configure(const std::string& config);
+		bool		isEnabled() const { return !m_specs.empty(); };
+		void		apply(std::vector<Reading *>& readings);
+		bool		hasExpired();
+		void		flush(std::vector<Reading *>& readings);
+
+	private:
+		/**
+		 * The join of a pair of assets along with the readings
+		 * it holds, by user timestamp in microseconds
+		 */
+		class Spec
+		{
+			public:
+				std::string	m_primary;
+				std::string	m_secondary;
+				std::string	m_asset;
+				std::string	m_prefix;
+				long long	m_tolerance;
+				bool		m_nearest;
+				// Readings of the secondary asset
+				std::deque<std::pair<long long, Reading *> >
+						m_secondaries;
+				// Primary readings waiting for a later
+				// secondary reading and the times they
+				// were received
+				std::deque<std::pair<long long, Reading *> >
+						m_pending;
+				std::deque<std::chrono::steady_clock::time_point>
+						m_received;
+				// Timestamp of the last primary reading
+				long long	m_horizon;
+		};
+
+		void		merge(Spec& spec, long long time, Reading* primary);
+		void		release(Spec& spec, std::vector<Reading *>& out);
+		bool		isExpired(const Spec& spec,
+					  std::chrono::steady_clock::time_point now) const;
+		void		trim(Spec& spec);
+
+	private:
+		// Serialises the ingest and the release of held readings
+		std::mutex	m_mutex;
+		// Held readings have been flushed, readings are now
+		// passed unchanged
+		bool		m_flushed;
+		std::vector<Spec>
+				m_specs;
+		// Index of the join and whether the asset is the
+		// primary one, by asset name
+		std::unordered_map<std::string, std::pair<size_t, bool> >
+				m_assets;
+};
+#endif
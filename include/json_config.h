@@ -0,0 +1,33 @@
+#ifndef _JSON_CONFIG_H
+#define _JSON_CONFIG_H
+/*
+ * FogLAMP "Simple Python 3.x" filter JSON configuration items.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <string>
+
+#include <Python.h>
+
+/**
+ * JsonConfig class parses the JSON configuration items of the
+ * windows, the deadband, the decimation, the joins and the lookup
+ * tables with the Python json module, and reports the items that
+ * are not valid in the same way.
+ *
+ * All methods must be called with the GIL held.
+ */
+class JsonConfig
+{
+	public:
+		static bool	parse(const std::string& config,
+				      PyTypeObject* type,
+				      PyObject*& value);
+		static bool	invalid(const char* usage);
+};
+#endif
@@ -0,0 +1,121 @@
+#ifndef _LOOKUP_TABLE_H
+#define _LOOKUP_TABLE_H
+/*
+ * FogLAMP "Simple Python 3.x" filter lookup tables.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <utility>
+#include <chrono>
+
+#include <Python.h>
+
+/**
+ * A CSV file read in memory along with an index of its lines by the
+ * value of their first column.
+ *
+ * The first line of the file holds the column names. Rows are only
+ * converted into Python objects when looked up, so a large table
+ * costs the memory of the file and of its index, once per process.
+ * The file is copied rather than mapped: it can be rewritten or
+ * truncated while in use. A file modified while it is read is read
+ * again.
+ *
+ * Instances are immutable and shared by all the filters of the
+ * process that use the same version of a file.
+ */
+class LookupTable
+{
+	public:
+		static std::shared_ptr<LookupTable>
+				load(const std::string& path);
+		bool		isCurrent() const;
+		size_t		size() const { return m_index.size(); };
+		const std::vector<std::string>&
+				getColumns() const { return m_columns; };
+		bool		find(const std::string& key,
+				     std::vector<std::string>& values) const;
+
+	private:
+		LookupTable(const std::string& path) :
+			    m_path(path),
+			    m_data(NULL),
+			    m_size(0),
+			    m_mtime(0),
+			    m_mtimeNsec(0)
+		{};
+		bool		open();
+
+	private:
+		// The path of the file
+		const std::string
+				m_path;
+		// The content of the file
+		std::string	m_content;
+		const char*	m_data;
+		size_t		m_size;
+		// Modification time of the file read
+		long		m_mtime;
+		long		m_mtimeNsec;
+		// Column names
+		std::vector<std::string>
+				m_columns;
+		// Offsets and lengths of the lines, by key
+		std::unordered_map<std::string, std::pair<size_t, size_t> >
+				m_index;
+
+		// Tables in use by path
+		static std::mutex
+				m_cacheMutex;
+		static std::map<std::string, std::weak_ptr<LookupTable> >
+				m_cache;
+};
+
+/**
+ * LookupTables class holds the lookup tables of a filter, passed to
+ * the Python code in the global 'lookups' dict as read-only mappings
+ * of foglamp_lookup.Table type, by name.
+ *
+ * A table is replaced by the new version of its file, if any, when
+ * refreshed, at most once per second: the code sees either the old
+ * or the new table, never a partly loaded one.
+ *
+ * The configuration is a JSON object of table names to file paths.
+ *
+ * All methods must be called with the GIL held.
+ */
+class LookupTables
+{
+	public:
+		LookupTables() : m_dict(NULL) {};
+		~LookupTables();
+
+		static bool	initialise();
+		bool		configure(const std::string& config);
+		bool		isEnabled() const { return !m_tables.empty(); };
+		PyObject*	getDict() const { return m_dict; };
+		bool		refresh();
+		void		swap(LookupTables& other);
+
+	private:
+		// Dict of the tables by name
+		PyObject*	m_dict;
+		// Paths and table objects, borrowed
+		std::vector<std::pair<std::string, PyObject *> >
+				m_tables;
+		// Time of the last refresh
+		std::chrono::steady_clock::time_point
+				m_refreshed;
+};
+#endif
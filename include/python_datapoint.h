@@ -0,0 +1,70 @@
+#ifndef _PYTHON_DATAPOINT_H
+#define _PYTHON_DATAPOINT_H
+/*
+ * FogLAMP "Simple Python 3.x" filter datapoint conversion.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include <reading.h>
+
+#include <Python.h>
+
+/**
+ * PythonDatapoint class converts single datapoint values between
+ * FogLAMP DatapointValue objects and Python objects, without
+ * converting a whole reading.
+ *
+ * Datapoint names are passed to Python as bytes keys or, when
+ * stringKeys is set, as interned str keys. Key objects are cached
+ * by name, so that the same key object is used for every reading.
+ *
+ * All methods but isSupported and toNumber must be called with the
+ * GIL held.
+ */
+class PythonDatapoint
+{
+	public:
+		static bool	isSupported(DatapointValue& value);
+		static bool	toNumber(DatapointValue& value, double& number);
+		static PyObject*
+				toPython(DatapointValue& value,
+					 bool stringKeys = false);
+		static DatapointValue*
+				toDatapointValue(PyObject* object,
+						 DatapointValue* original = NULL);
+		static Datapoint*
+				newDatapoint(const std::string& name,
+					     DatapointValue& value);
+		static void	setValue(DatapointValue& to,
+					 DatapointValue& from);
+		static PyObject*
+				nameToKey(const std::string& name,
+					  bool stringKeys = false);
+		static bool	keyToName(PyObject* key, std::string& name);
+		static const char*
+				bufferFormat(size_t itemSize);
+
+	private:
+		static DatapointValue*
+				newArray(std::vector<double>& values);
+		static DatapointValue*
+				newList(PyObject* object,
+					DatapointValue& original);
+		static DatapointValue*
+				fromBuffer(PyObject* object);
+
+	private:
+		// Key objects by datapoint name, bytes and str
+		static std::unordered_map<std::string, PyObject *>
+				m_keys[2];
+};
+#endif
@@ -0,0 +1,35 @@
+#ifndef _PYTHON_STATS_H
+#define _PYTHON_STATS_H
+/*
+ * FogLAMP "Simple Python 3.x" filter streaming statistics module.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <Python.h>
+
+/**
+ * PythonStats class creates the foglamp_stats Python module, which
+ * provides streaming accumulators implemented in C:
+ *
+ *	EWMA(alpha)			exponentially weighted moving average
+ *	Welford()			count, mean and variance
+ *	MinMax(decay=0.0)		minimum and maximum, optionally decaying
+ *					towards the latest value
+ *	QuantileSketch(accuracy=0.01)	mergeable quantile sketch with
+ *					relative accuracy, DDSketch-like
+ *
+ * The Python code creates accumulators once, in the setup code or
+ * in user_data, and updates them for each reading. Accumulators
+ * can be pickled, so those in user_data are kept in its checkpoints.
+ */
+class PythonStats
+{
+	public:
+		static bool	initialise();
+};
+#endif
@@ -0,0 +1,86 @@
+#ifndef _READING_CONTEXT_H
+#define _READING_CONTEXT_H
+/*
+ * FogLAMP "Simple Python 3.x" filter reading context.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <string>
+#include <vector>
+
+#include <reading.h>
+
+#include <Python.h>
+
+#include "code_cache.h"
+#include "array_view.h"
+
+/**
+ * ReadingContext class holds the Python objects passed to the code
+ * for a reading and reuses them for the next readings of a reading
+ * set, so that a reading the code does not modify costs no allocation.
+ *
+ * When the datapoints the code accesses are known, only these are
+ * converted into a dict and merged back into the reading, otherwise
+ * the reading is passed as a ReadingView.
+ *
+ * All methods must be called with the GIL held.
+ */
+class ReadingContext
+{
+	public:
+		ReadingContext() : m_assetCode(NULL),
+				   m_locals(NULL),
+				   m_view(NULL),
+				   m_projection(NULL),
+				   m_projected(false),
+				   m_code(NULL),
+				   m_reading(NULL)
+		{};
+		~ReadingContext();
+
+		PyObject*	prepare(Reading* reading,
+					CachedCode* code,
+					bool stringKeys,
+					bool arrayViews);
+		bool		isCurrent();
+		bool		writeBack();
+		void		done(bool deleted);
+
+	public:
+		// Python string of the asset name
+		PyObject*	m_assetCode;
+		// Last asset name sent to the asset tracker
+		std::string	m_trackedAsset;
+
+	private:
+		bool		writeBackProjection();
+		void		clearLocals();
+
+	private:
+		// Local variables of the code
+		PyObject*	m_locals;
+		// View of the current reading
+		PyObject*	m_view;
+		// Dict of the datapoints the code accesses
+		PyObject*	m_projection;
+		// The current reading is passed as m_projection
+		bool		m_projected;
+		// Values in m_projection before running the code
+		std::vector<PyObject *>
+				m_originals;
+		// The code run for the current reading
+		CachedCode*	m_code;
+		// The current reading
+		Reading*	m_reading;
+		// The asset name of m_assetCode
+		std::string	m_assetName;
+		// The memoryviews of the current reading
+		ArrayViews	m_arrays;
+};
+#endif
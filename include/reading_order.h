@@ -0,0 +1,35 @@
+#ifndef _READING_ORDER_H
+#define _READING_ORDER_H
+/*
+ * FogLAMP "Simple Python 3.x" filter ordering of readings.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <vector>
+
+#include <reading.h>
+
+/**
+ * ReadingOrder class puts the readings of each asset of a set of
+ * readings in user timestamp order, for the stages and the code that
+ * expect readings in order, such as the join, the mean decimation or
+ * an integration.
+ *
+ * The sort is stable and per asset: the readings of an asset take the
+ * places the readings of the asset had, so that the interleaving of
+ * assets is kept. Sets already in order, the common case, are only
+ * scanned once. Readings are only ordered within a set of readings.
+ */
+class ReadingOrder
+{
+	public:
+		static void	sort(std::vector<Reading *>& readings);
+		static long long
+				userTimestamp(Reading* reading);
+};
+#endif
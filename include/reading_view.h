@@ -0,0 +1,54 @@
+#ifndef _READING_VIEW_H
+#define _READING_VIEW_H
+/*
+ * FogLAMP "Simple Python 3.x" filter lazy reading view.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <reading.h>
+
+#include <Python.h>
+
+#include "array_view.h"
+
+/**
+ * ReadingView class manages the foglamp_reading.Reading Python type,
+ * a mapping type implemented in C which wraps a FogLAMP Reading.
+ *
+ * A datapoint value is converted into a Python object only when its
+ * name is accessed by the Python code. Writes and deletions are
+ * recorded and applied to the Reading by writeBack(), unmodified
+ * datapoints are never converted. The asset name and the timestamps,
+ * as int nanoseconds, are attributes read from the Reading when
+ * accessed and written back like the datapoints.
+ *
+ * Deallocated objects are kept on a free list and reused.
+ *
+ * All methods must be called with the GIL held.
+ */
+class ReadingView
+{
+	public:
+		static bool	initialise();
+		static bool	isSupported(Reading* reading);
+		static PyObject*
+				create(Reading* reading,
+				       bool stringKeys = false,
+				       ArrayViews* arrays = NULL);
+		static bool	check(PyObject* object);
+		static void	reset(PyObject* view, Reading* reading);
+		static bool	isModified(PyObject* view);
+		static bool	writeBack(PyObject* view);
+		static void	release(PyObject* view);
+		static PyObject*
+				getAssetWritten(PyObject* view);
+		static void	copyTimestamps(PyObject* view, Reading* reading);
+		static PyObject*
+				toDict(PyObject* view);
+};
+#endif
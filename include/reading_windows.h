@@ -0,0 +1,85 @@
+#ifndef _READING_WINDOWS_H
+#define _READING_WINDOWS_H
+/*
+ * FogLAMP "Simple Python 3.x" filter sliding windows of datapoints.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <utility>
+
+#include <reading.h>
+
+#include <Python.h>
+
+/**
+ * ReadingWindows class keeps, for each asset, the last values of
+ * configured numeric datapoints in fixed capacity ring buffers,
+ * along with the user timestamps of the readings.
+ *
+ * Windows are updated before the Python code runs for a reading, and
+ * for the readings within the deadband the code does not run for.
+ * They are passed to the code as foglamp_reading.Window objects, in the
+ * 'windows' dict, whose 'values' and 'timestamps' attributes are
+ * memoryviews of the ring buffers, oldest value first. The views are
+ * not copies: they are only valid while the current reading is
+ * processed, the next reading shifts the values they show.
+ *
+ * The configuration is a JSON object of asset names, or "*" for any
+ * asset, to objects of datapoint names and window sizes.
+ *
+ * All methods must be called with the GIL held.
+ */
+class ReadingWindows
+{
+	public:
+		ReadingWindows() : m_stringKeys(false), m_empty(NULL) {};
+		~ReadingWindows();
+
+		static bool	initialise();
+		bool		configure(const std::string& config,
+					  bool stringKeys);
+		bool		isEnabled() const { return !m_specs.empty(); };
+		PyObject*	update(Reading* reading);
+		void		swap(ReadingWindows& other);
+
+	private:
+		typedef std::vector<std::pair<std::string, Py_ssize_t> >
+				WindowSpec;
+
+		/**
+		 * The windows of an asset
+		 */
+		class AssetWindows
+		{
+			public:
+				// Dict of the windows by datapoint key
+				PyObject*	m_dict;
+				// Datapoint names and windows, borrowed
+				std::vector<std::pair<std::string, PyObject *> >
+						m_windows;
+		};
+
+		AssetWindows*	getAssetWindows(const std::string& asset);
+
+	private:
+		// Datapoints and window sizes by asset name
+		std::map<std::string, WindowSpec>
+				m_specs;
+		// Windows by asset name
+		std::unordered_map<std::string, AssetWindows>
+				m_assets;
+		// Datapoint names are str keys
+		bool		m_stringKeys;
+		// Dict passed for assets without windows
+		PyObject*	m_empty;
+};
+#endif
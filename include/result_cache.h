@@ -0,0 +1,96 @@
+#ifndef _RESULT_CACHE_H
+#define _RESULT_CACHE_H
+/*
+ * FogLAMP "Simple Python 3.x" filter cache of the code results.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+#include <reading.h>
+
+/**
+ * ResultCache class memoizes the changes the Python code makes to
+ * readings, for code that is a pure function of the datapoints it
+ * accesses and of the asset name.
+ *
+ * The key of a reading is its asset name and the values of the
+ * datapoints the code accesses, which must be integers, floats or
+ * strings. The changes the code made to these datapoints, and to the
+ * asset name, are kept for the most recently used keys and applied
+ * to the next readings with the same key without running the code.
+ *
+ * Methods are called by the ingest thread only, with the GIL held.
+ */
+class ResultCache
+{
+	public:
+		ResultCache() : m_capacity(0) {};
+		~ResultCache();
+
+		void		setCapacity(size_t capacity) { m_capacity = capacity; };
+		bool		isEnabled() const { return m_capacity > 0; };
+		void		clear();
+		bool		setKey(Reading* reading,
+				       const std::vector<std::string>& names);
+		bool		apply(Reading* reading,
+				      const std::vector<std::string>& names);
+		void		store(Reading* reading,
+				      const std::vector<std::string>& names,
+				      const std::string& inputAsset);
+
+	private:
+		/**
+		 * A change of a datapoint: a new value, or its removal
+		 */
+		class Change
+		{
+			public:
+				size_t		m_index;
+				DatapointValue*	m_value;
+		};
+
+		/**
+		 * The changes of a reading
+		 */
+		class Result
+		{
+			public:
+				Result() : m_renamed(false) {};
+				~Result();
+
+				std::vector<Change>
+						m_changes;
+				bool		m_renamed;
+				std::string	m_asset;
+		};
+
+		typedef std::list<std::pair<std::string, Result *> >
+				Entries;
+
+		static bool	encode(Datapoint* dp, std::string& encoded);
+
+	private:
+		// Results, most recently used first
+		Entries		m_entries;
+		// Results by key
+		std::unordered_map<std::string, Entries::iterator>
+				m_index;
+		// Maximum number of results
+		size_t		m_capacity;
+		// Key of the current reading
+		std::string	m_key;
+		// Encoded values of the datapoints of the current reading
+		std::vector<std::string>
+				m_inputs;
+};
+#endif
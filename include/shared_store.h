@@ -0,0 +1,38 @@
+#ifndef _SHARED_STORE_H
+#define _SHARED_STORE_H
+/*
+ * FogLAMP "Simple Python 3.x" filter shared memory store.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <Python.h>
+
+/**
+ * SharedStore class creates the foglamp_shared Python module, a store
+ * of numbers by name in a POSIX shared memory segment, shared by all
+ * the filters of all the services of the host:
+ *
+ *	get(key, default=None)	return the number of a key
+ *	set(key, value)		set the number of a key
+ *	add(key, delta=1)	add to the number of a key, return the sum
+ *	keys()			return the list of the keys
+ *
+ * Keys are str or bytes of up to 47 bytes. Numbers are stored as
+ * 64 bit floats, updated with atomic operations: no lock is taken,
+ * concurrent add() calls are not lost. Keys cannot be removed. A key
+ * being added by a process that exits before completing it is dropped;
+ * one that is not completed within 100ms raises RuntimeError.
+ *
+ * The segment is mapped the first time the code uses the module.
+ */
+class SharedStore
+{
+	public:
+		static bool	initialise();
+};
+#endif
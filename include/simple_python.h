@@ -11,12 +11,71 @@
  */
 
 #include <mutex>
+#include <memory>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <unordered_set>
 
 #include <filter_plugin.h>
 #include <filter.h>
 
 #include <Python.h>
 
+#include "code_cache.h"
+#include "reading_context.h"
+#include "reading_windows.h"
+#include "deadband.h"
+#include "decimation.h"
+#include "join.h"
+#include "reading_order.h"
+#include "result_cache.h"
+#include "lookup_table.h"
+#include "shared_store.h"
+#include "checkpoint.h"
+
+/**
+ * The compiled Python code of a filter configuration along with
+ * the global dictionary it runs with.
+ *
+ * Instances are shared by the ingest and timer threads and are
+ * replaced as a whole on reconfiguration.
+ */
+class CompiledCode
+{
+	public:
+		CompiledCode() : m_globals(NULL),
+				 m_hash(0),
+				 m_stringKeys(false),
+				 m_arrayViews(false)
+		{};
+		~CompiledCode();
+
+	public:
+		// Compiled per-reading code
+		std::shared_ptr<CachedCode>
+				m_code;
+		// Compiled timer code
+		std::shared_ptr<CachedCode>
+				m_timer;
+		// Global dictionary of the Python code
+		PyObject*	m_globals;
+		// Hash of the code configuration items, kept in checkpoints
+		uint64_t	m_hash;
+		// Datapoint names are passed as str keys
+		bool		m_stringKeys;
+		// Array datapoints are passed as memoryviews
+		bool		m_arrayViews;
+		// Sliding windows of datapoint values
+		ReadingWindows	m_windows;
+		// Memoized results of the per-reading code
+		ResultCache	m_results;
+		// Lookup tables passed to the code
+		LookupTables	m_lookups;
+};
+
 /**
  * SimplePythonFilter class is derived from FogLampFilter
  * It handles loading of a python module (provided script name)
@@ -32,22 +91,172 @@ class SimplePythonFilter : public FogLAMPFilter
 				   FogLAMPFilter(name,
 						 config,
 						 outHandle,
-						 output)
+						 output),
+				   m_timerInterval(0),
+				   m_stringKeys(false),
+				   m_arrayViews(false),
+				   m_deadbandDrop(false),
+				   m_sortReadings(false),
+				   m_memoize(0),
+				   m_checkpointInterval(0),
+				   m_codeHash(0),
+				   m_timerRunning(false),
+				   m_releaseRunning(false),
+				   m_checkpointRunning(false),
+				   m_checkpointFailed(false)
 		{};
+		~SimplePythonFilter();
+
+		// Stages of the ingest of readings, in order
+		enum Stage { SORT, JOIN, DECIMATION, CODE };
 
 		void	setEnableFilter(bool enable) { m_enabled = enable; };
 		bool	configure();
-		bool	reconfigure(const std::string& newConfig);
+		bool	configureWindows();
+		bool	configureLookups();
+		void	reconfigure(const std::string& newConfig);
+		void	waitCompilation();
+		std::shared_ptr<CompiledCode>
+			getCompiled();
+		bool	configureDeadband();
+		std::shared_ptr<Deadband>
+			getDeadband();
+		bool	configureDecimation();
+		std::shared_ptr<Decimation>
+			getDecimation();
+		bool	configureJoin();
+		std::shared_ptr<Join>
+			getJoin();
+		void	flushStages();
+		void	ingest(READINGSET* readingSet, Stage first = SORT);
 		void	lock() { m_configMutex.lock(); };
 		void	unlock() { m_configMutex.unlock(); };
-		void	logErrorMessage();
+		void	lockExecution();
+		void	unlockExecution() { m_execMutex.unlock(); };
+		void	logErrorMessage(const char* item,
+					const std::string& text = std::string());
+		void	processReading(Reading* reading,
+				       CompiledCode* compiled,
+				       ReadingContext& context,
+				       std::vector<Reading *>& out);
+		bool	fanOut(PyObject* inputDict,
+			       PyObject* fanOut,
+			       std::vector<Reading *>& out,
+			       const char* codeName,
+			       const char* variable,
+			       const std::string& source);
+		void	trackAsset(const std::string& assetName);
+		std::shared_ptr<CachedCode>
+			compileCode(const std::string& code,
+				    const char* name);
+		void	sendReadings(READINGSET* readingSet);
+		void	startTimer();
+		void	stopTimer();
+		void	checkpoint(CompiledCode* compiled);
+		void	stopCheckpoints();
+		void	saveUserData();
+
+	private:
+		uint64_t
+			codeHash();
+		bool	abandonCode(uint64_t hash);
+		void	timerLoop();
+		void	runTimerCode();
+		void	flushJoin(const std::shared_ptr<Join>& join);
+		void	flushDecimation(const std::shared_ptr<Decimation>& decimation);
+		void	startRelease();
+		void	stopRelease();
+		void	releaseLoop();
+		void	checkpointLoop();
+		void	writeCheckpoint(const Checkpoint& checkpoint);
 
 	public:
 		// Python  code to execute
 		std::string	m_code;
+		// Python code to execute once at configuration time
+		std::string	m_setup;
+		// Python code to execute periodically
+		std::string	m_timerCode;
+		// Seconds between timer code executions
+		unsigned int	m_timerInterval;
+		// Pass datapoint names as str rather than bytes keys
+		bool		m_stringKeys;
+		// Pass array datapoints as memoryviews rather than lists
+		bool		m_arrayViews;
+		// JSON configuration of the sliding windows
+		std::string	m_windows;
+		// JSON configuration of the deadband
+		std::string	m_deadband;
+		// Remove readings within the deadband rather than pass them
+		bool		m_deadbandDrop;
+		// JSON configuration of the decimation
+		std::string	m_decimation;
+		// JSON configuration of the joins of assets
+		std::string	m_join;
+		// Sort the readings of each asset by timestamp
+		bool		m_sortReadings;
+		// Number of memoized results, 0 for none
+		unsigned int	m_memoize;
+		// JSON configuration of the lookup tables
+		std::string	m_lookups;
+		// Seconds between checkpoints of user_data, 0 for none
+		unsigned int	m_checkpointInterval;
+		// Path of the checkpoint file
+		std::string	m_checkpointPath;
 
 	private:
 		// Configuration lock
 		std::mutex	m_configMutex;
+		// Serialises the executions of the per-reading and timer
+		// code, which share the global names and user_data: the
+		// GIL alone lets one run in the middle of the other
+		std::mutex	m_execMutex;
+		// Code in use, swapped under the configuration lock
+		std::shared_ptr<CompiledCode>
+				m_compiled;
+		// Deadband in use, swapped under the configuration lock
+		std::shared_ptr<Deadband>
+				m_activeDeadband;
+		// Decimation in use, swapped under the configuration lock
+		std::shared_ptr<Decimation>
+				m_activeDecimation;
+		// Join in use, swapped under the configuration lock
+		std::shared_ptr<Join>
+				m_activeJoin;
+		// Hash of the code items in use, or being compiled
+		uint64_t	m_codeHash;
+		// Background compilation on reconfiguration
+		std::thread	m_compileThread;
+		// Asset names already sent to the asset tracker
+		std::unordered_set<std::string>
+				m_trackedAssets;
+		// Serialises calls to the output stream
+		std::mutex	m_outputMutex;
+		// Timer thread
+		std::thread	m_timerThread;
+		std::mutex	m_timerMutex;
+		std::condition_variable
+				m_timerCV;
+		bool		m_timerRunning;
+		// Thread releasing the readings held for too long by the
+		// join and the decimation
+		std::thread	m_releaseThread;
+		std::mutex	m_releaseMutex;
+		std::condition_variable
+				m_releaseCV;
+		bool		m_releaseRunning;
+		// Checkpoint writer thread and the checkpoint it is to write
+		std::thread	m_checkpointThread;
+		std::mutex	m_checkpointMutex;
+		std::condition_variable
+				m_checkpointCV;
+		bool		m_checkpointRunning;
+		std::unique_ptr<Checkpoint>
+				m_pendingCheckpoint;
+		// Time of the last checkpoint and failure to take it,
+		// accessed with the GIL held
+		std::chrono::steady_clock::time_point
+				m_lastCheckpoint;
+		bool		m_checkpointFailed;
 };
 #endif
@@ -0,0 +1,353 @@
+/*
+ * FogLAMP "Simple Python 3.x" filter join of assets.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <string>
+#include <vector>
+#include <limits.h>
+#include <math.h>
+#include <reading.h>
+#include <Python.h>
+#include "join.h"
+#include "json_config.h"
+#include "reading_order.h"
+
+// Readings held by a join for each of its assets, at most
+#define JOIN_MAX_HELD	1000
+
+using namespace std;
+
+/**
+ * Return the string value of an item of a join, the default if the
+ * item is not set
+ */
+static bool getString(PyObject* item, const char* name, string& value, const char* defaultValue)
+{
+	PyObject* str = PyDict_GetItemString(item, name);
+	if (!str)
+	{
+		if (!defaultValue)
+		{
+			return false;
+		}
+		value = defaultValue;
+		return true;
+	}
+	const char* text = PyUnicode_Check(str) ? PyUnicode_AsUTF8(str) : NULL;
+	if (!text)
+	{
+		return false;
+	}
+	value = text;
+	return true;
+}
+
+/**
+ * Destructor: readings still held are deleted, flush() passes them on
+ */
+Join::~Join()
+{
+	for (auto spec = m_specs.begin(); spec != m_specs.end(); ++spec)
+	{
+		for (auto it = spec->m_secondaries.begin(); it != spec->m_secondaries.end(); ++it)
+		{
+			delete it->second;
+		}
+		for (auto it = spec->m_pending.begin(); it != spec->m_pending.end(); ++it)
+		{
+			delete it->second;
+		}
+	}
+}
+
+/**
+ * Set the join configuration
+ *
+ * The caller must hold the GIL.
+ *
+ * @param config	The JSON configuration, empty or [] for none
+ * @return		False with a Python error set if the
+ *			configuration is not valid
+ */
+bool Join::configure(const string& config)
+{
+	m_specs.clear();
+	m_assets.clear();
+
+	PyObject* joins;
+	bool valid = JsonConfig::parse(config, &PyList_Type, joins);
+	for (Py_ssize_t i = 0; valid && joins && i < PyList_GET_SIZE(joins); i++)
+	{
+		PyObject* item = PyList_GET_ITEM(joins, i);
+		Spec spec;
+		string match;
+		valid = PyDict_Check(item) &&
+			getString(item, "primary", spec.m_primary, NULL) &&
+			getString(item, "secondary", spec.m_secondary, NULL) &&
+			getString(item, "asset", spec.m_asset, "") &&
+			getString(item, "prefix", spec.m_prefix, "") &&
+			getString(item, "match", match, "nearest") &&
+			(match == "nearest" || match == "previous") &&
+			spec.m_primary != spec.m_secondary &&
+			m_assets.find(spec.m_primary) == m_assets.end() &&
+			m_assets.find(spec.m_secondary) == m_assets.end();
+		if (!valid)
+		{
+			break;
+		}
+
+		PyObject* seconds = PyDict_GetItemString(item, "tolerance");
+		double tolerance = !seconds ? 1.0 :
+				   PyLong_Check(seconds) || PyFloat_Check(seconds) ?
+				   PyFloat_AsDouble(seconds) :
+				   -1.0;
+		valid = tolerance >= 0.0 && tolerance < 1e12;
+		spec.m_tolerance = llround(tolerance * 1e6);
+		spec.m_nearest = match == "nearest";
+		spec.m_horizon = LLONG_MIN;
+
+		m_assets[spec.m_primary] = make_pair(m_specs.size(), true);
+		m_assets[spec.m_secondary] = make_pair(m_specs.size(), false);
+		m_specs.push_back(spec);
+	}
+	Py_XDECREF(joins);
+
+	if (!valid)
+	{
+		m_specs.clear();
+		m_assets.clear();
+		return JsonConfig::invalid("Join must be a JSON array of objects with "
+					   "different 'primary' and 'secondary' asset names, "
+					   "each asset in one join only, and optionally a "
+					   "'tolerance' in seconds, a 'match', 'nearest' or "
+					   "'previous', an 'asset' and a 'prefix'");
+	}
+	return true;
+}
+
+/**
+ * Add the datapoints of the secondary reading aligned with a primary
+ * reading to it, and set the asset name of the joined reading
+ *
+ * @param spec		The join
+ * @param time		The user timestamp of the primary reading
+ * @param primary	The primary reading
+ */
+void Join::merge(Spec& spec, long long time, Reading* primary)
+{
+	// Secondary readings after the time, then the last one at or before it
+	Reading* best = NULL;
+	long long distance = 0;
+	for (auto it = spec.m_secondaries.rbegin(); it != spec.m_secondaries.rend(); ++it)
+	{
+		bool before = it->first <= time;
+		if (before || spec.m_nearest)
+		{
+			long long d = before ? time - it->first : it->first - time;
+			if (d <= spec.m_tolerance && (!best || d <= distance))
+			{
+				best = it->second;
+				distance = d;
+			}
+		}
+		if (before)
+		{
+			break;
+		}
+	}
+
+	if (best)
+	{
+		vector<Datapoint *>& datapoints = best->getReadingData();
+		for (auto dp = datapoints.begin(); dp != datapoints.end(); ++dp)
+		{
+			// Datapoints of the primary reading are kept
+			string name = spec.m_prefix + (*dp)->getName();
+			if (!primary->getDatapoint(name))
+			{
+				DatapointValue value((*dp)->getData());
+				primary->addDatapoint(new Datapoint(name, value));
+			}
+		}
+	}
+	if (!spec.m_asset.empty())
+	{
+		primary->setAssetName(spec.m_asset);
+	}
+}
+
+/**
+ * Pass on the oldest held primary reading, joined with the secondary
+ * readings received so far
+ *
+ * @param spec		The join
+ * @param out		The output readings
+ */
+void Join::release(Spec& spec, vector<Reading *>& out)
+{
+	merge(spec, spec.m_pending.front().first, spec.m_pending.front().second);
+	out.push_back(spec.m_pending.front().second);
+	spec.m_pending.pop_front();
+	spec.m_received.pop_front();
+}
+
+/**
+ * Check whether the oldest held primary reading of a join has been
+ * held for longer than the tolerance
+ *
+ * @param spec		The join
+ * @param now		The current time
+ */
+bool Join::isExpired(const Spec& spec, chrono::steady_clock::time_point now) const
+{
+	return !spec.m_received.empty() &&
+	       now - spec.m_received.front() >= chrono::microseconds(spec.m_tolerance);
+}
+
+/**
+ * Check whether a primary reading has been held for longer than
+ * the tolerance, apply() then passes it on
+ */
+bool Join::hasExpired()
+{
+	lock_guard<mutex> guard(m_mutex);
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+	for (auto spec = m_specs.begin(); spec != m_specs.end(); ++spec)
+	{
+		if (isExpired(*spec, now))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Pass on the held primary readings, joined with the secondary
+ * readings received so far, and delete the secondary readings.
+ * Readings passed to the join afterwards are not joined.
+ *
+ * @param readings	The readings the held readings are added to
+ */
+void Join::flush(vector<Reading *>& readings)
+{
+	lock_guard<mutex> guard(m_mutex);
+	m_flushed = true;
+	for (auto spec = m_specs.begin(); spec != m_specs.end(); ++spec)
+	{
+		while (!spec->m_pending.empty())
+		{
+			release(*spec, readings);
+		}
+		for (auto it = spec->m_secondaries.begin(); it != spec->m_secondaries.end(); ++it)
+		{
+			delete it->second;
+		}
+		spec->m_secondaries.clear();
+	}
+}
+
+/**
+ * Delete the secondary readings no later primary reading can be
+ * joined with: those followed by another one at or before the
+ * oldest primary reading to come
+ *
+ * @param spec		The join
+ */
+void Join::trim(Spec& spec)
+{
+	long long horizon = spec.m_pending.empty() ?
+			    spec.m_horizon :
+			    spec.m_pending.front().first;
+	while (spec.m_secondaries.size() > JOIN_MAX_HELD ||
+	       (spec.m_secondaries.size() > 1 &&
+		spec.m_secondaries[1].first <= horizon))
+	{
+		delete spec.m_secondaries.front().second;
+		spec.m_secondaries.pop_front();
+	}
+}
+
+/**
+ * Join the readings
+ *
+ * Joined readings are passed in place of the reading that completes
+ * them: the primary reading itself, or the secondary reading after
+ * a held primary reading. Secondary readings are removed. Primary
+ * readings held for longer than the tolerance are passed first.
+ *
+ * @param readings	The readings, replaced by the output readings
+ */
+void Join::apply(vector<Reading *>& readings)
+{
+	lock_guard<mutex> guard(m_mutex);
+	if (m_flushed)
+	{
+		return;
+	}
+
+	vector<Reading *> out;
+	out.reserve(readings.size());
+
+	// Stop waiting for the secondary readings of the expired ones
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+	for (auto spec = m_specs.begin(); spec != m_specs.end(); ++spec)
+	{
+		while (isExpired(*spec, now))
+		{
+			release(*spec, out);
+		}
+	}
+
+	for (auto elem = readings.begin(); elem != readings.end(); ++elem)
+	{
+		Reading* reading = *elem;
+		auto found = m_assets.find(reading->getAssetName());
+		if (found == m_assets.end())
+		{
+			out.push_back(reading);
+			continue;
+		}
+
+		Spec& spec = m_specs[found->second.first];
+		long long time = ReadingOrder::userTimestamp(reading);
+		if (found->second.second)
+		{
+			spec.m_horizon = time;
+			if (!spec.m_nearest ||
+			    (!spec.m_secondaries.empty() && spec.m_secondaries.back().first >= time))
+			{
+				merge(spec, time, reading);
+				out.push_back(reading);
+			}
+			else
+			{
+				spec.m_pending.push_back(make_pair(time, reading));
+				spec.m_received.push_back(now);
+				if (spec.m_pending.size() > JOIN_MAX_HELD)
+				{
+					// Stop waiting for the secondary asset
+					release(spec, out);
+				}
+			}
+		}
+		else
+		{
+			spec.m_secondaries.push_back(make_pair(time, reading));
+			// Primary readings up to this one can now be joined
+			while (!spec.m_pending.empty() && spec.m_pending.front().first <= time)
+			{
+				release(spec, out);
+			}
+		}
+		trim(spec);
+	}
+
+	readings.swap(out);
+}
@@ -0,0 +1,62 @@
+/*
+ * FogLAMP "Simple Python 3.x" filter JSON configuration items.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <string>
+#include "json_config.h"
+
+using namespace std;
+
+/**
+ * Parse a JSON configuration item into Python objects
+ *
+ * An item holding only white space sets none.
+ *
+ * @param config	The JSON configuration item
+ * @param type		The type of the parsed value, dict or list
+ * @param value		Set to a new reference to the parsed value,
+ *			NULL if the item is blank or not valid
+ * @return		False if the item is not JSON, with the Python
+ *			error set, or if the value is not of the type
+ */
+bool JsonConfig::parse(const string& config, PyTypeObject* type, PyObject*& value)
+{
+	value = NULL;
+	if (config.find_first_not_of(" \t\r\n") == string::npos)
+	{
+		return true;
+	}
+
+	PyObject* json = PyImport_ImportModule("json");
+	value = json ?
+		PyObject_CallMethod(json, "loads", "s", config.c_str()) :
+		NULL;
+	Py_XDECREF(json);
+	if (value && !PyObject_TypeCheck(value, type))
+	{
+		Py_CLEAR(value);
+	}
+	return value != NULL;
+}
+
+/**
+ * Report a configuration item that is not valid: the error of the
+ * item, if any, is kept, otherwise its expected content is given
+ *
+ * @param usage		The expected content of the item
+ * @return		False
+ */
+bool JsonConfig::invalid(const char* usage)
+{
+	if (!PyErr_Occurred())
+	{
+		PyErr_SetString(PyExc_ValueError, usage);
+	}
+	return false;
+}
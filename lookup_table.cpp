@@ -0,0 +1,657 @@
+/*
+ * FogLAMP "Simple Python 3.x" filter lookup tables.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <string>
+#include <logger.h>
+#include "lookup_table.h"
+#include "json_config.h"
+
+using namespace std;
+
+// Minimum interval between checks of the table files
+#define REFRESH_INTERVAL	chrono::seconds(1)
+// Attempts to read a file modified while it is read
+#define READ_ATTEMPTS		3
+
+mutex LookupTable::m_cacheMutex;
+map<string, weak_ptr<LookupTable> > LookupTable::m_cache;
+
+/**
+ * Split a CSV line into fields. Fields may be enclosed in double
+ * quotes, with double quotes in them doubled.
+ *
+ * @param p		The start of the line
+ * @param end		The end of the line, without the line feed
+ * @param fields	Set to the fields
+ * @param max		The maximum number of fields to split
+ */
+static void splitFields(const char* p,
+			const char* end,
+			vector<string>& fields,
+			size_t max = (size_t)-1)
+{
+	fields.clear();
+	if (end > p && end[-1] == '\r')
+	{
+		end--;
+	}
+	while (fields.size() < max)
+	{
+		string field;
+		if (p < end && *p == '"')
+		{
+			for (p++; p < end; p++)
+			{
+				if (*p != '"')
+				{
+					field += *p;
+				}
+				else if (p + 1 < end && p[1] == '"')
+				{
+					field += *++p;
+				}
+				else
+				{
+					p++;
+					break;
+				}
+			}
+			while (p < end && *p != ',')
+			{
+				p++;
+			}
+		}
+		else
+		{
+			const char* start = p;
+			while (p < end && *p != ',')
+			{
+				p++;
+			}
+			field.assign(start, p - start);
+		}
+		fields.push_back(field);
+		if (p >= end)
+		{
+			break;
+		}
+		p++;
+	}
+}
+
+/**
+ * Return the table of the current version of a file, loading it if
+ * no filter of the process uses it yet
+ *
+ * @param path		The path of the CSV file
+ * @return		The table, empty with errno set if the file
+ *			cannot be read
+ */
+shared_ptr<LookupTable> LookupTable::load(const string& path)
+{
+	lock_guard<mutex> guard(m_cacheMutex);
+
+	auto found = m_cache.find(path);
+	if (found != m_cache.end())
+	{
+		shared_ptr<LookupTable> table = found->second.lock();
+		if (table && table->isCurrent())
+		{
+			return table;
+		}
+	}
+
+	shared_ptr<LookupTable> table(new LookupTable(path));
+	bool loaded = table->open();
+	for (int attempt = 1; !loaded && errno == EAGAIN && attempt < READ_ATTEMPTS; attempt++)
+	{
+		table.reset(new LookupTable(path));
+		loaded = table->open();
+	}
+	if (!loaded)
+	{
+		int error = errno;
+		table.reset();
+		errno = error;
+		return table;
+	}
+	m_cache[path] = table;
+	return table;
+}
+
+/**
+ * Read the file and index its lines
+ *
+ * The file is copied in memory, so that it can be modified or
+ * truncated while the table is in use.
+ *
+ * @return	False with errno set if the file cannot be read,
+ *		EAGAIN if it was modified while being read
+ */
+bool LookupTable::open()
+{
+	int fd = ::open(m_path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+	{
+		int error = errno;
+		close(fd);
+		errno = error;
+		return false;
+	}
+	m_size = st.st_size;
+	m_mtime = st.st_mtim.tv_sec;
+	m_mtimeNsec = st.st_mtim.tv_nsec;
+
+	m_content.resize(m_size);
+	size_t done = 0;
+	while (done < m_size)
+	{
+		ssize_t n = read(fd, &m_content[done], m_size - done);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			break;
+		}
+		done += n;
+	}
+	int error = done < m_size ? errno : 0;
+	bool modified = done == m_size &&
+			(fstat(fd, &st) < 0 ||
+			 (size_t)st.st_size != m_size ||
+			 st.st_mtim.tv_sec != m_mtime ||
+			 st.st_mtim.tv_nsec != m_mtimeNsec);
+	close(fd);
+	if (done < m_size || modified)
+	{
+		// A short read is a truncation unless read() failed
+		errno = error && done < m_size ? error : EAGAIN;
+		return false;
+	}
+	m_data = m_content.data();
+
+	vector<string> fields;
+	size_t offset = 0;
+	bool header = true;
+	while (offset < m_size)
+	{
+		const char* start = m_data + offset;
+		const char* newline = (const char *)memchr(start, '\n', m_size - offset);
+		size_t length = newline ? newline - start : m_size - offset;
+		if (length && !(length == 1 && *start == '\r'))
+		{
+			if (header)
+			{
+				splitFields(start, start + length, m_columns);
+				header = false;
+			}
+			else
+			{
+				splitFields(start, start + length, fields, 1);
+				// The first line of a key is used
+				m_index.emplace(fields[0], make_pair(offset, length));
+			}
+		}
+		offset += length + 1;
+	}
+	return true;
+}
+
+/**
+ * Check whether the file has not been replaced or modified since
+ * it was read
+ */
+bool LookupTable::isCurrent() const
+{
+	struct stat st;
+	return stat(m_path.c_str(), &st) == 0 &&
+	       (size_t)st.st_size == m_size &&
+	       st.st_mtim.tv_sec == m_mtime &&
+	       st.st_mtim.tv_nsec == m_mtimeNsec;
+}
+
+/**
+ * Find the row of a key
+ *
+ * @param key		The key, the value of the first column
+ * @param values	Set to the values of the other columns
+ * @return		False if the key is not found
+ */
+bool LookupTable::find(const string& key, vector<string>& values) const
+{
+	auto found = m_index.find(key);
+	if (found == m_index.end())
+	{
+		return false;
+	}
+	const char* line = m_data + found->second.first;
+	splitFields(line, line + found->second.second, values);
+	values.erase(values.begin());
+	return true;
+}
+
+/**
+ * The Python object of a lookup table
+ */
+typedef struct {
+	PyObject_HEAD
+	// The current version of the table
+	shared_ptr<LookupTable>*
+			table;
+} TableObject;
+
+static PyTypeObject TableType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+};
+
+static void tableDealloc(TableObject* self)
+{
+	delete self->table;
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/**
+ * Convert a key into the text of the first column: str and bytes
+ * are used as they are, other objects such as integers as str()
+ *
+ * @return	False with the Python error set on failure
+ */
+static bool keyText(PyObject* key, string& text)
+{
+	if (PyBytes_Check(key))
+	{
+		text.assign(PyBytes_AS_STRING(key), PyBytes_GET_SIZE(key));
+		return true;
+	}
+	PyObject* str = PyUnicode_Check(key) ? key : PyObject_Str(key);
+	if (!str)
+	{
+		return false;
+	}
+	Py_ssize_t size;
+	const char* utf8 = PyUnicode_AsUTF8AndSize(str, &size);
+	if (utf8)
+	{
+		text.assign(utf8, size);
+	}
+	if (str != key)
+	{
+		Py_DECREF(str);
+	}
+	return utf8 != NULL;
+}
+
+/**
+ * Check whether a field is a plain decimal number: an optional sign,
+ * digits with an optional decimal point and an optional exponent
+ *
+ * @param text		The field
+ * @param integer	Set if the number has no decimal point or exponent
+ */
+static bool isDecimal(const char* text, bool& integer)
+{
+	const char* p = text;
+	if (*p == '+' || *p == '-')
+	{
+		p++;
+	}
+	size_t digits = 0;
+	for (; *p >= '0' && *p <= '9'; p++)
+	{
+		digits++;
+	}
+	integer = true;
+	if (*p == '.')
+	{
+		integer = false;
+		for (p++; *p >= '0' && *p <= '9'; p++)
+		{
+			digits++;
+		}
+	}
+	if (!digits)
+	{
+		return false;
+	}
+	if (*p == 'e' || *p == 'E')
+	{
+		integer = false;
+		p++;
+		if (*p == '+' || *p == '-')
+		{
+			p++;
+		}
+		if (!(*p >= '0' && *p <= '9'))
+		{
+			return false;
+		}
+		while (*p >= '0' && *p <= '9')
+		{
+			p++;
+		}
+	}
+	return *p == '\0';
+}
+
+/**
+ * Convert a field: decimal integers and floats become numbers, empty
+ * fields None, other fields, such as "nan" or "0x1F", str
+ */
+static PyObject* fieldValue(const string& field)
+{
+	if (field.empty())
+	{
+		Py_RETURN_NONE;
+	}
+	const char* text = field.c_str();
+	bool integer;
+	if (strlen(text) == field.length() && isDecimal(text, integer))
+	{
+		errno = 0;
+		long long value = integer ? strtoll(text, NULL, 10) : 0;
+		if (integer && errno == 0)
+		{
+			return PyLong_FromLongLong(value);
+		}
+		return PyFloat_FromDouble(strtod(text, NULL));
+	}
+	return PyUnicode_DecodeUTF8(field.data(), field.length(), "replace");
+}
+
+/**
+ * Return the tuple of the values of the row of a key
+ *
+ * @return	New reference, NULL without error set if the key
+ *		is not found or with the Python error set on failure
+ */
+static PyObject* tableFind(TableObject* self, PyObject* key)
+{
+	string text;
+	if (!keyText(key, text))
+	{
+		return NULL;
+	}
+	vector<string> values;
+	if (!(*self->table)->find(text, values))
+	{
+		return NULL;
+	}
+	PyObject* row = PyTuple_New(values.size());
+	for (size_t i = 0; row && i < values.size(); i++)
+	{
+		PyObject* value = fieldValue(values[i]);
+		if (!value)
+		{
+			Py_CLEAR(row);
+			break;
+		}
+		PyTuple_SET_ITEM(row, i, value);
+	}
+	return row;
+}
+
+static PyObject* tableSubscript(TableObject* self, PyObject* key)
+{
+	PyObject* row = tableFind(self, key);
+	if (!row && !PyErr_Occurred())
+	{
+		PyErr_SetObject(PyExc_KeyError, key);
+	}
+	return row;
+}
+
+static int tableContains(TableObject* self, PyObject* key)
+{
+	PyObject* row = tableFind(self, key);
+	if (!row)
+	{
+		return PyErr_Occurred() ? -1 : 0;
+	}
+	Py_DECREF(row);
+	return 1;
+}
+
+static Py_ssize_t tableLength(TableObject* self)
+{
+	return (*self->table)->size();
+}
+
+static PyObject* tableGet(TableObject* self, PyObject* args)
+{
+	PyObject* key;
+	PyObject* defaultValue = Py_None;
+	if (!PyArg_ParseTuple(args, "O|O:get", &key, &defaultValue))
+	{
+		return NULL;
+	}
+	PyObject* row = tableFind(self, key);
+	if (!row && !PyErr_Occurred())
+	{
+		Py_INCREF(defaultValue);
+		return defaultValue;
+	}
+	return row;
+}
+
+static PyObject* tableGetColumns(TableObject* self, void* closure)
+{
+	const vector<string>& columns = (*self->table)->getColumns();
+	PyObject* names = PyTuple_New(columns.size() > 1 ? columns.size() - 1 : 0);
+	for (size_t i = 1; names && i < columns.size(); i++)
+	{
+		PyObject* name = PyUnicode_DecodeUTF8(columns[i].data(),
+						      columns[i].length(),
+						      "replace");
+		if (!name)
+		{
+			Py_CLEAR(names);
+			break;
+		}
+		PyTuple_SET_ITEM(names, i - 1, name);
+	}
+	return names;
+}
+
+static PyMethodDef tableMethods[] = {
+	{ "get", (PyCFunction)tableGet, METH_VARARGS,
+	  "Return the values of a key, or the default" },
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyGetSetDef tableGetSet[] = {
+	{ (char *)"columns", (getter)tableGetColumns, NULL,
+	  (char *)"The names of the columns of the values", NULL },
+	{ NULL, NULL, NULL, NULL, NULL }
+};
+
+static PyMappingMethods tableMapping;
+static PySequenceMethods tableSequence;
+
+/**
+ * Create the table type, once
+ *
+ * @return	False if the type cannot be created
+ */
+bool LookupTables::initialise()
+{
+	if (TableType.tp_flags & Py_TPFLAGS_READY)
+	{
+		return true;
+	}
+
+	tableMapping.mp_length = (lenfunc)tableLength;
+	tableMapping.mp_subscript = (binaryfunc)tableSubscript;
+	tableSequence.sq_contains = (objobjproc)tableContains;
+
+	TableType.tp_name = "foglamp_reading.LookupTable";
+	TableType.tp_doc = "The rows of a CSV file by the value of their first column";
+	TableType.tp_basicsize = sizeof(TableObject);
+	TableType.tp_flags = Py_TPFLAGS_DEFAULT;
+	TableType.tp_dealloc = (destructor)tableDealloc;
+	TableType.tp_as_mapping = &tableMapping;
+	TableType.tp_as_sequence = &tableSequence;
+	TableType.tp_methods = tableMethods;
+	TableType.tp_getset = tableGetSet;
+
+	if (PyType_Ready(&TableType) < 0)
+	{
+		return false;
+	}
+
+	PyObject* module = PyImport_AddModule("foglamp_reading");
+	Py_INCREF(&TableType);
+	if (!module || PyModule_AddObject(module, "LookupTable", (PyObject *)&TableType) < 0)
+	{
+		PyErr_Clear();
+	}
+
+	return true;
+}
+
+/**
+ * Destructor: release the tables
+ */
+LookupTables::~LookupTables()
+{
+	PyGILState_STATE state = PyGILState_Ensure();
+	Py_CLEAR(m_dict);
+	PyGILState_Release(state);
+}
+
+/**
+ * Load the lookup tables
+ *
+ * @param config	The JSON configuration, empty or {} for none
+ * @return		False with the Python error set if the
+ *			configuration is not valid or a file cannot
+ *			be read
+ */
+bool LookupTables::configure(const string& config)
+{
+	Py_CLEAR(m_dict);
+	m_tables.clear();
+	m_refreshed = chrono::steady_clock::now();
+
+	if ((m_dict = PyDict_New()) == NULL)
+	{
+		return false;
+	}
+
+	PyObject* lookups;
+	bool valid = JsonConfig::parse(config, &PyDict_Type, lookups);
+	PyObject *name, *path;
+	Py_ssize_t pos = 0;
+	while (valid && lookups && PyDict_Next(lookups, &pos, &name, &path))
+	{
+		const char* file = PyUnicode_Check(path) ? PyUnicode_AsUTF8(path) : NULL;
+		valid = PyUnicode_Check(name) && file;
+		if (!valid)
+		{
+			break;
+		}
+		shared_ptr<LookupTable> table = LookupTable::load(file);
+		if (!table)
+		{
+			PyErr_SetFromErrnoWithFilename(PyExc_OSError, file);
+			valid = false;
+			break;
+		}
+		TableObject* object = PyObject_New(TableObject, &TableType);
+		if (!object)
+		{
+			valid = false;
+			break;
+		}
+		object->table = new shared_ptr<LookupTable>(table);
+		valid = PyDict_SetItem(m_dict, name, (PyObject *)object) == 0;
+		if (valid)
+		{
+			m_tables.push_back(make_pair(string(file), (PyObject *)object));
+		}
+		Py_DECREF(object);
+	}
+	Py_XDECREF(lookups);
+
+	if (!valid)
+	{
+		Py_CLEAR(m_dict);
+		m_tables.clear();
+		return JsonConfig::invalid("Lookups must be a JSON object of table names "
+					   "to paths of CSV files");
+	}
+	return true;
+}
+
+/**
+ * Exchange the tables with those of another instance
+ *
+ * @param other		The other tables
+ */
+void LookupTables::swap(LookupTables& other)
+{
+	std::swap(m_dict, other.m_dict);
+	m_tables.swap(other.m_tables);
+	std::swap(m_refreshed, other.m_refreshed);
+}
+
+/**
+ * Replace the tables whose file has changed by the new version
+ *
+ * A table whose new version cannot be read is kept.
+ *
+ * @return	True if a table has been replaced
+ */
+bool LookupTables::refresh()
+{
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+	if (m_tables.empty() || now - m_refreshed < REFRESH_INTERVAL)
+	{
+		return false;
+	}
+	m_refreshed = now;
+
+	bool replaced = false;
+	for (auto it = m_tables.begin(); it != m_tables.end(); ++it)
+	{
+		shared_ptr<LookupTable>* table = ((TableObject *)it->second)->table;
+		if ((*table)->isCurrent())
+		{
+			continue;
+		}
+		shared_ptr<LookupTable> newTable = LookupTable::load(it->first);
+		if (newTable)
+		{
+			*table = newTable;
+			replaced = true;
+		}
+		else
+		{
+			Logger::getLogger()->warn("Lookup table file '%s' cannot be "
+						  "read, the current table remains "
+						  "active: %s",
+						  it->first.c_str(),
+						  strerror(errno));
+		}
+	}
+	return replaced;
+}
@@ -44,6 +44,109 @@ static const char *default_config = QUOTE({
 		"displayName": "Python code",
 		"default": "",
 		"order" : "1"
+		},
+	"setup": {
+		"description": "Python code executed once when the filter is configured, names it defines are visible to the Python code",
+		"type": "code",
+		"displayName": "Setup code",
+		"default": "",
+		"order" : "2"
+		},
+	"timerCode": {
+		"description": "Python code executed periodically, readings it adds to the 'readings' list are sent onwards",
+		"type": "code",
+		"displayName": "Timer code",
+		"default": "",
+		"order" : "3"
+		},
+	"timerInterval": {
+		"description": "Interval in seconds between executions of the timer code",
+		"type": "integer",
+		"displayName": "Timer interval",
+		"default": "10",
+		"minimum": "1",
+		"order" : "4"
+		},
+	"keyType": {
+		"description": "The type of the datapoint names in the 'reading' dict: bytes, e.g. reading[b'temperature'], or str, e.g. reading['temperature']",
+		"type": "enumeration",
+		"options": ["bytes", "str"],
+		"displayName": "Datapoint name type",
+		"default": "bytes",
+		"order" : "5"
+		},
+	"arrayViews": {
+		"description": "Pass float array and data buffer datapoints as read-only memoryviews of the reading data rather than as lists",
+		"type": "boolean",
+		"displayName": "Array views",
+		"default": "false",
+		"order" : "6"
+		},
+	"windows": {
+		"description": "Sliding windows of datapoint values passed to the Python code in the 'windows' dict: a JSON object of asset names, or * for any asset, to objects of datapoint names and window sizes",
+		"type": "JSON",
+		"displayName": "Windows",
+		"default": "{}",
+		"order" : "7"
+		},
+	"deadband": {
+		"description": "Readings whose datapoints have not changed by more than a threshold since the last reading of the asset processed are not processed: a JSON object of asset names, or * for any asset, to objects of datapoint names and absolute thresholds, or percentages such as \"2%\"",
+		"type": "JSON",
+		"displayName": "Deadband",
+		"default": "{}",
+		"order" : "8"
+		},
+	"deadbandAction": {
+		"description": "The action for readings within the deadband: skip the Python code and pass them unchanged, or drop them",
+		"type": "enumeration",
+		"options": ["skip", "drop"],
+		"displayName": "Deadband action",
+		"default": "skip",
+		"order" : "9"
+		},
+	"decimation": {
+		"description": "Readings of high rate assets reduced before they are processed: a JSON object of asset names, or * for any asset, to objects with a mode, 'every' with a 'count' of readings, or 'first' or 'mean' with an 'interval' in seconds",
+		"type": "JSON",
+		"displayName": "Decimation",
+		"default": "{}",
+		"order" : "10"
+		},
+	"memoize": {
+		"description": "Number of results of the Python code kept for the values of the datapoints it uses, applied without running the code to readings with the same values, 0 to disable. Only for code depending on nothing but these values and the asset name: code using lookups, user_data, other global names the timer code changes, the time or random numbers must not be memoized",
+		"type": "integer",
+		"displayName": "Memoized results",
+		"default": "0",
+		"minimum": "0",
+		"order" : "11"
+		},
+	"lookups": {
+		"description": "Lookup tables passed to the Python code in the 'lookups' dict: a JSON object of table names to paths of CSV files, whose rows are found by the value of their first column",
+		"type": "JSON",
+		"displayName": "Lookup tables",
+		"default": "{}",
+		"order" : "12"
+		},
+	"checkpointInterval": {
+		"description": "Seconds between checkpoints of the 'user_data' dict to a local file, which is restored when the filter restarts with the same Python code, 0 to disable",
+		"type": "integer",
+		"displayName": "Checkpoint interval",
+		"default": "0",
+		"minimum": "0",
+		"order" : "13"
+		},
+	"join": {
+		"description": "Pairs of assets whose readings are merged, aligned on their timestamps, before they are processed: a JSON array of objects with the 'primary' and 'secondary' asset names, the 'tolerance' in seconds, the 'match', 'nearest' or 'previous', and optionally the 'asset' name of the joined readings and a 'prefix' for the secondary datapoint names",
+		"type": "JSON",
+		"displayName": "Join",
+		"default": "[]",
+		"order" : "14"
+		},
+	"sortReadings": {
+		"description": "Sort the readings of each asset of a set of readings by timestamp before they are joined, decimated and processed, for code that expects readings in order",
+		"type": "boolean",
+		"displayName": "Sort readings",
+		"default": "false",
+		"order" : "15"
 		}
 	});
 
@@ -115,111 +218,105 @@ PLUGIN_HANDLE plugin_init(ConfigCategory* config,
 		return NULL;
 	}
 
-	// Embedded Python initialisation
-	PythonRuntime::getPythonRuntime();
+	if (config->itemExists("setup"))
+	{
+		handle->m_setup = config->getValue("setup");
+	}
 
-	return (PLUGIN_HANDLE)handle;
-}
+	if (config->itemExists("timerCode"))
+	{
+		handle->m_timerCode = config->getValue("timerCode");
+	}
 
-/**
- * Ingest a set of readings into the plugin for processing
- *
- * @param handle	The plugin handle returned from plugin_init
- * @param readingSet	The readings to process
- */
-void plugin_ingest(PLUGIN_HANDLE *handle,
-		   READINGSET *readingSet)
-{
-	SimplePythonFilter* filter = (SimplePythonFilter *)handle;
-	bool enabled = false;
-	string pythonCode;
+	if (config->itemExists("timerInterval"))
+	{
+		handle->m_timerInterval = atoi(config->getValue("timerInterval").c_str());
+	}
 
-	// Lock configuration items
-	filter->lock();
-	enabled = filter->isEnabled();
-	pythonCode = filter->m_code;
-	// Unlock configuration items
-	filter->unlock();
+	if (config->itemExists("keyType"))
+	{
+		handle->m_stringKeys = config->getValue("keyType").compare("str") == 0;
+	}
 
-	if (!enabled || !pythonCode.length())
+	if (config->itemExists("arrayViews"))
 	{
-		// Current filter is not active: just pass the readings set
-		filter->m_func(filter->m_data, readingSet);
-		return;
+		handle->m_arrayViews = config->getValue("arrayViews").compare("true") == 0 ||
+				       config->getValue("arrayViews").compare("True") == 0;
 	}
 
-	PyGILState_STATE state = PyGILState_Ensure(); // acquire GIL
+	if (config->itemExists("windows"))
+	{
+		handle->m_windows = config->getValue("windows");
+	}
 
-	// Returns borrowed reference: do not remove object
-	PyObject* main = PyImport_AddModule("__main__");
-	// Returns borrowed reference: do not remove object
-	PyObject* globalDictionary = PyModule_GetDict(main);
+	if (config->itemExists("memoize"))
+	{
+		handle->m_memoize = atoi(config->getValue("memoize").c_str());
+	}
 
-	// New reference, to remove
-	PyObject* userData = PyDict_New();
+	if (config->itemExists("lookups"))
+	{
+		handle->m_lookups = config->getValue("lookups");
+	}
 
-	// Create a global variable, dict, called "user_data"
-	// Python code can access it via: global user_data
-	PyDict_SetItemString(globalDictionary, "user_data", userData);
+	if (config->itemExists("checkpointInterval"))
+	{
+		handle->m_checkpointInterval = atoi(config->getValue("checkpointInterval").c_str());
+	}
+	handle->m_checkpointPath = Checkpoint::getPath(handle->getConfig().getName());
 
-	// Just get all the readings in the readingset
-	vector<Reading *>* readings = ((ReadingSet *)readingSet)->getAllReadingsPtr();
+	if (config->itemExists("deadband"))
+	{
+		handle->m_deadband = config->getValue("deadband");
+	}
 
-	// Iterate the input readings
-	for (vector<Reading *>::iterator elem = readings->begin();
-					 elem != readings->end(); )
+	if (config->itemExists("deadbandAction"))
 	{
-		PythonReading *pyReading = (PythonReading *)(*elem);
-		PyObject* inputDict = pyReading->toPython(true);
-
-		// Run Python code (with statements separated by \n)
-		PyObject* run = PyRun_String(("exec(" + pythonCode + ")").c_str(),
-					     Py_file_input,
-					     globalDictionary,
-					     inputDict);
-
-		if (PyErr_Occurred())
-		{
-			filter->logErrorMessage();
-			elem++;
-		}
-		else
-		{
-			// Delete reading data along with datapoints
-			delete(*elem);
-
-			// Set new Reading object with data returned from PyRun_String
-			*elem = new PythonReading(inputDict);
-
-			// Check
-			if (*elem != NULL)
-			{
-				// Call asset tracker
-				AssetTracker::getAssetTracker()->addAssetTrackingTuple(filter->getConfig().getName(),
-									(*elem)->getAssetName(),
-									string("Filter"));
-				elem++;
-			}
-			else
-			{
-				// Remove current reading from result set
-				elem = readings->erase(elem);
-			}
-		}
+		handle->m_deadbandDrop = config->getValue("deadbandAction").compare("drop") == 0;
+	}
+
+	if (config->itemExists("decimation"))
+	{
+		handle->m_decimation = config->getValue("decimation");
+	}
+
+	if (config->itemExists("join"))
+	{
+		handle->m_join = config->getValue("join");
+	}
 
-		Py_CLEAR(run);
-		Py_CLEAR(inputDict);
+	if (config->itemExists("sortReadings"))
+	{
+		handle->m_sortReadings = config->getValue("sortReadings").compare("true") == 0 ||
+					 config->getValue("sortReadings").compare("True") == 0;
 	}
 
-	// Remove user_data from dict
-	PyDict_DelItemString(globalDictionary, "user_data");
+	// Embedded Python initialisation
+	PythonRuntime::getPythonRuntime();
 
-	Py_CLEAR(userData);
+	// Set up the join, the decimation and the deadband of the readings
+	handle->configureJoin();
+	handle->configureDecimation();
+	handle->configureDeadband();
 
-	PyGILState_Release(state);
+	// Compile the code and run the setup code
+	handle->configure();
 
-	// Pass readingSet to the next filter
-	filter->m_func(filter->m_data, readingSet);
+	return (PLUGIN_HANDLE)handle;
+}
+
+/**
+ * Ingest a set of readings into the plugin for processing
+ *
+ * @param handle	The plugin handle returned from plugin_init
+ * @param readingSet	The readings to process
+ */
+void plugin_ingest(PLUGIN_HANDLE *handle,
+		   READINGSET *readingSet)
+{
+	SimplePythonFilter* filter = (SimplePythonFilter *)handle;
+
+	filter->ingest(readingSet);
 }
 
 /**
@@ -229,6 +326,19 @@ void plugin_shutdown(PLUGIN_HANDLE *handle)
 {
 	SimplePythonFilter* filter = (SimplePythonFilter *)handle;
 
+	// Wait for a pending compilation: it may start the timer and
+	// replaces the code whose user_data is saved
+	filter->waitCompilation();
+
+	// Stop the timer thread
+	filter->stopTimer();
+
+	// Pass on the readings held by the join and the decimation
+	filter->flushStages();
+
+	// Save user_data for the next start
+	filter->saveUserData();
+
 	// Remove filter object	
 	delete filter;
 }
@@ -242,74 +352,9 @@ void plugin_shutdown(PLUGIN_HANDLE *handle)
 void plugin_reconfigure(PLUGIN_HANDLE *handle, const string& newConfig)
 {
 	SimplePythonFilter* filter = (SimplePythonFilter *)handle;
-	ConfigCategory category("new", newConfig);
-
-	// Lock configuration items
-	filter->lock();
 
-	// Update Python code to execute
-	if (category.itemExists("code"))
-	{
-		filter->m_code = category.getValue("code");
-	}
-
-	// Update the enable flag
-	if (category.itemExists("enable"))
-	{
-		bool enabled = category.getValue("enable").compare("true") == 0 ||
-				category.getValue("enable").compare("True") == 0;
-
-		filter->setEnableFilter(enabled);
-	}
-
-	// Unlock configuration items
-	filter->unlock();
+	filter->reconfigure(newConfig);
 }
 
 // End of extern "C"
 };
-
-/**
- * Log current Python 3.x error message
- */
-void SimplePythonFilter::logErrorMessage()
-{
-#ifdef PYTHON_CONSOLE_DEBUG
-	// Print full Python stacktrace 
-	PyErr_Print();
-#endif
-	//Get error message
-	PyObject *pType, *pValue, *pTraceback;
-	PyErr_Fetch(&pType, &pValue, &pTraceback);
-	PyErr_NormalizeException(&pType, &pValue, &pTraceback);
-
-	PyObject* str_exc_value = PyObject_Repr(pValue);
-	PyObject* pyExcValueStr = PyUnicode_AsEncodedString(str_exc_value,
-							    "utf-8",
-							    "Error ~");
-
-	// NOTE from :
-	// https://docs.python.org/3.5/c-api/exceptions.html
-	//
-	// The value and traceback object may be NULL
-	// even when the type object is not.	
-	const char* pErrorMessage = pValue ?
-				    PyBytes_AsString(pyExcValueStr) :
-				    "no error description.";
-
-	Logger::getLogger()->fatal("Filter '%s', Python code "
-				   "'%s': Error '%s'",
-				   this->getConfig().getName().c_str(), 
-				   m_code.c_str(),
-				   pErrorMessage);
-
-	// Reset error
-	PyErr_Clear();
-
-	// Remove references
-	Py_CLEAR(pType);
-	Py_CLEAR(pValue);
-	Py_CLEAR(pTraceback);
-	Py_CLEAR(str_exc_value);
-	Py_CLEAR(pyExcValueStr);
-}
@@ -0,0 +1,601 @@
+/*
+ * FogLAMP "Simple Python 3.x" filter datapoint conversion.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <string.h>
+#include <stdint.h>
+#include <reading.h>
+#include "python_datapoint.h"
+
+using namespace std;
+
+// Upper bound of the number of cached keys of each type
+#define MAX_CACHED_KEYS	4096
+
+unordered_map<string, PyObject *> PythonDatapoint::m_keys[2];
+
+/**
+ * Check whether a datapoint value can be converted by this class.
+ *
+ * Readings with other datapoint types, such as images, are
+ * converted by PythonReading.
+ *
+ * @param value		The datapoint value
+ * @return		True if supported
+ */
+bool PythonDatapoint::isSupported(DatapointValue& value)
+{
+	switch (value.getType())
+	{
+	case DatapointValue::T_INTEGER:
+	case DatapointValue::T_FLOAT:
+	case DatapointValue::T_STRING:
+	case DatapointValue::T_FLOAT_ARRAY:
+	case DatapointValue::T_DATABUFFER:
+		return true;
+	case DatapointValue::T_DP_DICT:
+	case DatapointValue::T_DP_LIST:
+	{
+		vector<Datapoint *>* dps = value.getDpVec();
+		for (auto it = dps->begin(); it != dps->end(); ++it)
+		{
+			if (!isSupported((*it)->getData()))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+/**
+ * Return the value of an integer or float datapoint as a double
+ *
+ * @param value		The datapoint value
+ * @param number	Set to the value
+ * @return		False if the value is not an integer or a float
+ */
+bool PythonDatapoint::toNumber(DatapointValue& value, double& number)
+{
+	switch (value.getType())
+	{
+	case DatapointValue::T_INTEGER:
+		number = (double)value.toInt();
+		return true;
+	case DatapointValue::T_FLOAT:
+		number = value.toDouble();
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * Convert a datapoint value into a Python object
+ *
+ * @param value		The datapoint value
+ * @param stringKeys	Use str keys for the names in dicts
+ * @return		New reference to the Python object,
+ *			NULL with the Python error set on error
+ */
+PyObject* PythonDatapoint::toPython(DatapointValue& value, bool stringKeys)
+{
+	switch (value.getType())
+	{
+	case DatapointValue::T_INTEGER:
+		return PyLong_FromLong(value.toInt());
+	case DatapointValue::T_FLOAT:
+		return PyFloat_FromDouble(value.toDouble());
+	case DatapointValue::T_STRING:
+	{
+		string str = value.toStringValue();
+		return PyUnicode_FromStringAndSize(str.data(), str.length());
+	}
+	case DatapointValue::T_FLOAT_ARRAY:
+	{
+		vector<double>* values = value.getDpArr();
+		PyObject* list = PyList_New(values->size());
+		for (size_t i = 0; list && i < values->size(); i++)
+		{
+			PyList_SET_ITEM(list, i, PyFloat_FromDouble((*values)[i]));
+		}
+		return list;
+	}
+	case DatapointValue::T_DATABUFFER:
+	{
+		// An array.array of the items, converted back to a DataBuffer
+		// of the same item size
+		static PyObject* arrayType = NULL;
+		if (!arrayType)
+		{
+			PyObject* module = PyImport_ImportModule("array");
+			arrayType = module ? PyObject_GetAttrString(module, "array") : NULL;
+			Py_XDECREF(module);
+			if (!arrayType)
+			{
+				return NULL;
+			}
+		}
+		DataBuffer* buffer = value.getDataBuffer();
+		const char* format = bufferFormat(buffer->getItemSize());
+		PyObject* bytes = PyBytes_FromStringAndSize((const char *)buffer->getData(),
+							    buffer->getItemSize() *
+							    buffer->getItemCount());
+		PyObject* array = bytes ?
+				  PyObject_CallFunction(arrayType, "sO",
+							format ? format : "B",
+							bytes) :
+				  NULL;
+		Py_XDECREF(bytes);
+		return array;
+	}
+	case DatapointValue::T_DP_DICT:
+	{
+		vector<Datapoint *>* dps = value.getDpVec();
+		PyObject* dict = PyDict_New();
+		for (auto it = dps->begin(); dict && it != dps->end(); ++it)
+		{
+			PyObject* key = nameToKey((*it)->getName(), stringKeys);
+			PyObject* item = toPython((*it)->getData(), stringKeys);
+			if (!key || !item || PyDict_SetItem(dict, key, item) < 0)
+			{
+				Py_CLEAR(dict);
+			}
+			Py_CLEAR(key);
+			Py_CLEAR(item);
+		}
+		return dict;
+	}
+	case DatapointValue::T_DP_LIST:
+	{
+		vector<Datapoint *>* dps = value.getDpVec();
+		PyObject* list = PyList_New(dps->size());
+		for (size_t i = 0; list && i < dps->size(); i++)
+		{
+			PyObject* item = toPython((*dps)[i]->getData(), stringKeys);
+			if (!item)
+			{
+				Py_CLEAR(list);
+				break;
+			}
+			PyList_SET_ITEM(list, i, item);
+		}
+		return list;
+	}
+	default:
+		PyErr_SetString(PyExc_TypeError, "Unsupported datapoint type");
+		return NULL;
+	}
+}
+
+/**
+ * Convert a Python object into a new datapoint value.
+ *
+ * Supported objects are int, float, str, bytes, lists or tuples
+ * of numbers, objects supporting the buffer protocol with a
+ * numeric format, such as numpy arrays, and dicts of supported
+ * objects.
+ *
+ * Lists and tuples become float arrays, unless they replace a list
+ * datapoint value: they then become a list of supported objects
+ * again, so that a list the code has not modified keeps its type.
+ * Dicts convert their items in the same way.
+ *
+ * @param object	The Python object
+ * @param original	The value the object replaces, if any
+ * @return		New datapoint value, NULL with the Python
+ *			error set if the object is not supported
+ */
+DatapointValue* PythonDatapoint::toDatapointValue(PyObject* object,
+						  DatapointValue* original)
+{
+	if (PyLong_Check(object))
+	{
+		long value = PyLong_AsLong(object);
+		if (value == -1 && PyErr_Occurred())
+		{
+			return NULL;
+		}
+		return new DatapointValue(value);
+	}
+	if (PyFloat_Check(object))
+	{
+		return new DatapointValue(PyFloat_AS_DOUBLE(object));
+	}
+	if (PyUnicode_Check(object))
+	{
+		Py_ssize_t size;
+		const char* str = PyUnicode_AsUTF8AndSize(object, &size);
+		if (!str)
+		{
+			return NULL;
+		}
+		return new DatapointValue(string(str, size));
+	}
+	if (PyBytes_Check(object))
+	{
+		return new DatapointValue(string(PyBytes_AS_STRING(object),
+						 PyBytes_GET_SIZE(object)));
+	}
+	if ((PyList_Check(object) || PyTuple_Check(object)) &&
+	    original && original->getType() == DatapointValue::T_DP_LIST)
+	{
+		return newList(object, *original);
+	}
+	if (PyList_Check(object) || PyTuple_Check(object))
+	{
+		PyObject* seq = PySequence_Fast(object, "");
+		Py_ssize_t size = PySequence_Fast_GET_SIZE(seq);
+		PyObject** items = PySequence_Fast_ITEMS(seq);
+		vector<double> values;
+		values.reserve(size);
+		for (Py_ssize_t i = 0; i < size; i++)
+		{
+			double value = PyFloat_AsDouble(items[i]);
+			if (value == -1.0 && PyErr_Occurred())
+			{
+				Py_CLEAR(seq);
+				PyErr_SetString(PyExc_TypeError,
+						"Only lists of numbers are supported");
+				return NULL;
+			}
+			values.push_back(value);
+		}
+		Py_CLEAR(seq);
+		return newArray(values);
+	}
+	if (PyObject_CheckBuffer(object))
+	{
+		return fromBuffer(object);
+	}
+	if (PyDict_Check(object))
+	{
+		vector<Datapoint *>* items =
+			original && original->getType() == DatapointValue::T_DP_DICT ?
+			original->getDpVec() :
+			NULL;
+		vector<Datapoint *>* dps = new vector<Datapoint *>;
+		PyObject *key, *item;
+		Py_ssize_t pos = 0;
+		while (PyDict_Next(object, &pos, &key, &item))
+		{
+			string name;
+			DatapointValue* value = NULL;
+			DatapointValue* itemOriginal = NULL;
+			bool named = keyToName(key, name);
+			for (size_t i = 0; named && items && i < items->size(); i++)
+			{
+				if ((*items)[i]->getName() == name)
+				{
+					itemOriginal = &(*items)[i]->getData();
+					break;
+				}
+			}
+			if (!named ||
+			    (value = toDatapointValue(item, itemOriginal)) == NULL)
+			{
+				for (auto it = dps->begin(); it != dps->end(); ++it)
+				{
+					delete *it;
+				}
+				delete dps;
+				return NULL;
+			}
+			dps->push_back(newDatapoint(name, *value));
+			delete value;
+		}
+		return new DatapointValue(dps, true);
+	}
+
+	PyErr_Format(PyExc_TypeError,
+		     "Unsupported datapoint value type '%s'",
+		     Py_TYPE(object)->tp_name);
+	return NULL;
+}
+
+/**
+ * Return the buffer format of the items of a DataBuffer, unsigned
+ * integers of their size
+ *
+ * @param itemSize	The size of the items in bytes
+ * @return		The format, NULL if no integer has this size
+ */
+const char* PythonDatapoint::bufferFormat(size_t itemSize)
+{
+	switch (itemSize)
+	{
+	case sizeof(unsigned char):
+		return "B";
+	case sizeof(unsigned short):
+		return "H";
+	case sizeof(unsigned int):
+		return "I";
+	case sizeof(unsigned long long):
+		return "Q";
+	default:
+		return NULL;
+	}
+}
+
+/**
+ * Return a new float array datapoint value, taking the values
+ * rather than copying them
+ *
+ * @param values	The values, empty on return
+ * @return		The new datapoint value
+ */
+DatapointValue* PythonDatapoint::newArray(vector<double>& values)
+{
+	vector<double> empty;
+	DatapointValue* value = new DatapointValue(empty);
+	value->getDpArr()->swap(values);
+	return value;
+}
+
+/**
+ * Return a new list datapoint value of the items of a list or a
+ * tuple, each converted along with the item of the original list
+ * at the same position, whose name it gets
+ *
+ * @param object	The list or tuple
+ * @param original	The list datapoint value it replaces
+ * @return		The new datapoint value, NULL with the Python
+ *			error set if an item is not supported
+ */
+DatapointValue* PythonDatapoint::newList(PyObject* object, DatapointValue& original)
+{
+	vector<Datapoint *>* items = original.getDpVec();
+	PyObject* seq = PySequence_Fast(object, "");
+	Py_ssize_t size = PySequence_Fast_GET_SIZE(seq);
+	PyObject** objects = PySequence_Fast_ITEMS(seq);
+	vector<Datapoint *>* dps = new vector<Datapoint *>;
+	dps->reserve(size);
+	for (Py_ssize_t i = 0; i < size; i++)
+	{
+		bool known = (size_t)i < items->size();
+		DatapointValue* value = toDatapointValue(objects[i],
+							 known ? &(*items)[i]->getData() : NULL);
+		if (!value)
+		{
+			for (auto it = dps->begin(); it != dps->end(); ++it)
+			{
+				delete *it;
+			}
+			delete dps;
+			Py_CLEAR(seq);
+			return NULL;
+		}
+		dps->push_back(newDatapoint(known ? (*items)[i]->getName() : to_string(i),
+					    *value));
+		delete value;
+	}
+	Py_CLEAR(seq);
+	return new DatapointValue(dps, false);
+}
+
+/**
+ * Convert an object supporting the buffer protocol into a new
+ * datapoint value, copying its memory at once.
+ *
+ * One-dimensional buffers of doubles become float arrays, floats
+ * are converted, integers and bytes become a DataBuffer of items
+ * of their size. Zero-dimensional buffers, such as numpy scalars,
+ * become numbers.
+ *
+ * @param object	The Python object
+ * @return		New datapoint value, NULL with the Python
+ *			error set if the buffer is not supported
+ */
+DatapointValue* PythonDatapoint::fromBuffer(PyObject* object)
+{
+	Py_buffer view;
+	if (PyObject_GetBuffer(object, &view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) < 0)
+	{
+		return NULL;
+	}
+
+	// Native byte order only
+	const char* format = view.format ? view.format : "B";
+	uint16_t order = 1;
+	bool littleEndian = *(uint8_t *)&order == 1;
+	if (*format == '@' || *format == '=' ||
+	    (*format == '<' && littleEndian) ||
+	    (*format == '>' && !littleEndian))
+	{
+		format++;
+	}
+
+	DatapointValue* value = NULL;
+	size_t count = view.itemsize ? view.len / view.itemsize : 0;
+	bool isFloat = (*format == 'd' || *format == 'f') && format[1] == 0;
+	bool isInteger = format[1] == 0 && strchr("bBhHiIlLqQnNc", *format) != NULL;
+
+	if (view.ndim > 1 || (!isFloat && !isInteger))
+	{
+		PyErr_Format(PyExc_TypeError,
+			     "Unsupported buffer of format '%s' and %d dimensions",
+			     view.format ? view.format : "B", view.ndim);
+	}
+	else if (view.ndim == 0 && *format == 'd')
+	{
+		value = new DatapointValue(*(double *)view.buf);
+	}
+	else if (view.ndim == 0 && *format == 'f')
+	{
+		value = new DatapointValue((double)*(float *)view.buf);
+	}
+	else if (view.ndim == 0)
+	{
+		PyObject* number = PyNumber_Long(object);
+		if (number)
+		{
+			value = toDatapointValue(number);
+			Py_DECREF(number);
+		}
+	}
+	else if (*format == 'd')
+	{
+		vector<double> values(count);
+		memcpy(values.data(), view.buf, count * sizeof(double));
+		value = newArray(values);
+	}
+	else if (*format == 'f')
+	{
+		vector<double> values(count);
+		const float* items = (const float *)view.buf;
+		for (size_t i = 0; i < count; i++)
+		{
+			values[i] = items[i];
+		}
+		value = newArray(values);
+	}
+	else
+	{
+		DataBuffer* buffer = new DataBuffer(view.itemsize, count);
+		memcpy(buffer->getData(), view.buf, view.len);
+		value = new DatapointValue(buffer);
+	}
+
+	PyBuffer_Release(&view);
+	return value;
+}
+
+/**
+ * Create a new datapoint, taking the values of a float array
+ * rather than copying them
+ *
+ * @param name		The datapoint name
+ * @param value		The datapoint value, may be emptied
+ * @return		The new datapoint
+ */
+Datapoint* PythonDatapoint::newDatapoint(const string& name, DatapointValue& value)
+{
+	if (value.getType() != DatapointValue::T_FLOAT_ARRAY)
+	{
+		return new Datapoint(name, value);
+	}
+	vector<double> empty;
+	DatapointValue placeholder(empty);
+	Datapoint* dp = new Datapoint(name, placeholder);
+	setValue(dp->getData(), value);
+	return dp;
+}
+
+/**
+ * Set a datapoint value, taking the values of a float array
+ * rather than copying them
+ *
+ * @param to		The datapoint value to set
+ * @param from		The new value, may be emptied
+ */
+void PythonDatapoint::setValue(DatapointValue& to, DatapointValue& from)
+{
+	if (to.getType() == DatapointValue::T_FLOAT_ARRAY &&
+	    from.getType() == DatapointValue::T_FLOAT_ARRAY)
+	{
+		swap(to.getDpArr(), from.getDpArr());
+	}
+	else
+	{
+		to = from;
+	}
+}
+
+/**
+ * Return the Python dict key for a datapoint name.
+ *
+ * Keys are cached: a cached key has its hash computed already
+ * and a str key is interned, so that a lookup with a constant
+ * of the Python code matches it by identity.
+ *
+ * @param name		The datapoint name
+ * @param stringKeys	Return a str key rather than a bytes key
+ * @return		New reference to the key
+ */
+PyObject* PythonDatapoint::nameToKey(const string& name, bool stringKeys)
+{
+	unordered_map<string, PyObject *>& keys = m_keys[stringKeys ? 1 : 0];
+	auto it = keys.find(name);
+	if (it != keys.end())
+	{
+		Py_INCREF(it->second);
+		return it->second;
+	}
+
+	PyObject* key;
+	if (stringKeys)
+	{
+		key = PyUnicode_FromStringAndSize(name.data(), name.length());
+		if (key)
+		{
+			PyUnicode_InternInPlace(&key);
+		}
+	}
+	else
+	{
+		key = PyBytes_FromStringAndSize(name.data(), name.length());
+	}
+	if (!key || PyObject_Hash(key) == -1)
+	{
+		Py_XDECREF(key);
+		return NULL;
+	}
+
+	if (keys.size() >= MAX_CACHED_KEYS)
+	{
+		// Names are not bounded by a schema: start again
+		for (auto it = keys.begin(); it != keys.end(); ++it)
+		{
+			Py_DECREF(it->second);
+		}
+		keys.clear();
+	}
+	Py_INCREF(key);
+	keys[name] = key;
+	return key;
+}
+
+/**
+ * Return the datapoint name for a Python dict key,
+ * which can be either bytes or str
+ *
+ * @param key		The Python key
+ * @param name		The datapoint name
+ * @return		False with the Python error set if
+ *			the key is neither bytes nor str
+ */
+bool PythonDatapoint::keyToName(PyObject* key, string& name)
+{
+	if (PyBytes_Check(key))
+	{
+		name.assign(PyBytes_AS_STRING(key), PyBytes_GET_SIZE(key));
+		return true;
+	}
+	if (PyUnicode_Check(key))
+	{
+		Py_ssize_t size;
+		const char* str = PyUnicode_AsUTF8AndSize(key, &size);
+		if (!str)
+		{
+			return false;
+		}
+		name.assign(str, size);
+		return true;
+	}
+	PyErr_Format(PyExc_TypeError,
+		     "Datapoint names must be bytes or str, not '%s'",
+		     Py_TYPE(key)->tp_name);
+	return false;
+}
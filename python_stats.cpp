@@ -0,0 +1,809 @@
+/*
+ * FogLAMP "Simple Python 3.x" filter streaming statistics module.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <map>
+#include <math.h>
+#include <string.h>
+#include "python_stats.h"
+#include <structmember.h>
+
+using namespace std;
+
+// Smallest absolute value counted apart from zero by the sketch
+#define SKETCH_MIN_VALUE	1e-9
+// Lowest accuracy for which the bucket index of any finite value fits an int
+#define SKETCH_MIN_ACCURACY	1e-6
+// Accuracy and maximum number of buckets by default
+#define SKETCH_ACCURACY		0.01
+#define SKETCH_MAX_BINS		2048
+
+/**
+ * Return None for an accumulator without values, otherwise the value
+ */
+static PyObject* optionalValue(long long count, double value)
+{
+	if (!count)
+	{
+		Py_RETURN_NONE;
+	}
+	return PyFloat_FromDouble(value);
+}
+
+/**
+ * Exponentially weighted moving average
+ */
+typedef struct {
+	PyObject_HEAD
+	double		alpha;
+	double		value;
+	long long	count;
+} EwmaObject;
+
+static PyTypeObject EwmaType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+};
+
+static int ewmaInit(EwmaObject* self, PyObject* args, PyObject* kwds)
+{
+	static const char* kwlist[] = { "alpha", NULL };
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "d", (char **)kwlist, &self->alpha))
+	{
+		return -1;
+	}
+	if (!(self->alpha > 0.0 && self->alpha <= 1.0))
+	{
+		PyErr_SetString(PyExc_ValueError, "alpha must be in (0, 1]");
+		return -1;
+	}
+	self->value = 0.0;
+	self->count = 0;
+	return 0;
+}
+
+static PyObject* ewmaUpdate(EwmaObject* self, PyObject* arg)
+{
+	double x = PyFloat_AsDouble(arg);
+	if (x == -1.0 && PyErr_Occurred())
+	{
+		return NULL;
+	}
+	if (self->count++)
+	{
+		self->value += self->alpha * (x - self->value);
+	}
+	else
+	{
+		self->value = x;
+	}
+	return PyFloat_FromDouble(self->value);
+}
+
+static PyObject* ewmaReset(EwmaObject* self, PyObject* unused)
+{
+	self->value = 0.0;
+	self->count = 0;
+	Py_RETURN_NONE;
+}
+
+static PyObject* ewmaGetValue(EwmaObject* self, void* closure)
+{
+	return optionalValue(self->count, self->value);
+}
+
+static PyObject* ewmaReduce(EwmaObject* self, PyObject* unused)
+{
+	return Py_BuildValue("O(d)(dL)", Py_TYPE(self), self->alpha,
+			     self->value, self->count);
+}
+
+static PyObject* ewmaSetState(EwmaObject* self, PyObject* state)
+{
+	if (!PyArg_ParseTuple(state, "dL", &self->value, &self->count))
+	{
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef ewmaMethods[] = {
+	{ "update", (PyCFunction)ewmaUpdate, METH_O, "Add a value, return the average" },
+	{ "reset", (PyCFunction)ewmaReset, METH_NOARGS, "Remove all values" },
+	{ "__reduce__", (PyCFunction)ewmaReduce, METH_NOARGS, NULL },
+	{ "__setstate__", (PyCFunction)ewmaSetState, METH_O, NULL },
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyMemberDef ewmaMembers[] = {
+	{ (char *)"alpha", T_DOUBLE, offsetof(EwmaObject, alpha), READONLY, NULL },
+	{ (char *)"count", T_LONGLONG, offsetof(EwmaObject, count), READONLY, NULL },
+	{ NULL, 0, 0, 0, NULL }
+};
+
+static PyGetSetDef ewmaGetSet[] = {
+	{ (char *)"value", (getter)ewmaGetValue, NULL,
+	  (char *)"The average, None without values", NULL },
+	{ NULL, NULL, NULL, NULL, NULL }
+};
+
+/**
+ * Welford mean and variance
+ */
+typedef struct {
+	PyObject_HEAD
+	long long	count;
+	double		mean;
+	double		m2;
+} WelfordObject;
+
+static PyTypeObject WelfordType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+};
+
+static int welfordInit(WelfordObject* self, PyObject* args, PyObject* kwds)
+{
+	static const char* kwlist[] = { NULL };
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "", (char **)kwlist))
+	{
+		return -1;
+	}
+	self->count = 0;
+	self->mean = 0.0;
+	self->m2 = 0.0;
+	return 0;
+}
+
+static PyObject* welfordUpdate(WelfordObject* self, PyObject* arg)
+{
+	double x = PyFloat_AsDouble(arg);
+	if (x == -1.0 && PyErr_Occurred())
+	{
+		return NULL;
+	}
+	self->count++;
+	double delta = x - self->mean;
+	self->mean += delta / self->count;
+	self->m2 += delta * (x - self->mean);
+	return PyFloat_FromDouble(self->mean);
+}
+
+static PyObject* welfordMerge(WelfordObject* self, PyObject* arg)
+{
+	if (Py_TYPE(arg) != &WelfordType)
+	{
+		PyErr_SetString(PyExc_TypeError, "Only a Welford can be merged");
+		return NULL;
+	}
+	WelfordObject* other = (WelfordObject *)arg;
+	long long count = self->count + other->count;
+	if (other->count)
+	{
+		double delta = other->mean - self->mean;
+		self->mean += delta * other->count / count;
+		self->m2 += other->m2 +
+			    delta * delta * self->count * other->count / count;
+		self->count = count;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject* welfordReset(WelfordObject* self, PyObject* unused)
+{
+	self->count = 0;
+	self->mean = 0.0;
+	self->m2 = 0.0;
+	Py_RETURN_NONE;
+}
+
+static PyObject* welfordGetMean(WelfordObject* self, void* closure)
+{
+	return optionalValue(self->count, self->mean);
+}
+
+static PyObject* welfordGetVariance(WelfordObject* self, void* closure)
+{
+	return optionalValue(self->count, self->count ? self->m2 / self->count : 0.0);
+}
+
+static PyObject* welfordGetSampleVariance(WelfordObject* self, void* closure)
+{
+	return optionalValue(self->count > 1, self->count > 1 ? self->m2 / (self->count - 1) : 0.0);
+}
+
+static PyObject* welfordGetStddev(WelfordObject* self, void* closure)
+{
+	return optionalValue(self->count, self->count ? sqrt(self->m2 / self->count) : 0.0);
+}
+
+static PyObject* welfordReduce(WelfordObject* self, PyObject* unused)
+{
+	return Py_BuildValue("O()(Ldd)", Py_TYPE(self),
+			     self->count, self->mean, self->m2);
+}
+
+static PyObject* welfordSetState(WelfordObject* self, PyObject* state)
+{
+	if (!PyArg_ParseTuple(state, "Ldd", &self->count, &self->mean, &self->m2))
+	{
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef welfordMethods[] = {
+	{ "update", (PyCFunction)welfordUpdate, METH_O, "Add a value, return the mean" },
+	{ "merge", (PyCFunction)welfordMerge, METH_O, "Add the values of another Welford" },
+	{ "reset", (PyCFunction)welfordReset, METH_NOARGS, "Remove all values" },
+	{ "__reduce__", (PyCFunction)welfordReduce, METH_NOARGS, NULL },
+	{ "__setstate__", (PyCFunction)welfordSetState, METH_O, NULL },
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyMemberDef welfordMembers[] = {
+	{ (char *)"count", T_LONGLONG, offsetof(WelfordObject, count), READONLY, NULL },
+	{ NULL, 0, 0, 0, NULL }
+};
+
+static PyGetSetDef welfordGetSet[] = {
+	{ (char *)"mean", (getter)welfordGetMean, NULL,
+	  (char *)"The mean, None without values", NULL },
+	{ (char *)"variance", (getter)welfordGetVariance, NULL,
+	  (char *)"The population variance", NULL },
+	{ (char *)"sample_variance", (getter)welfordGetSampleVariance, NULL,
+	  (char *)"The sample variance, None with less than two values", NULL },
+	{ (char *)"stddev", (getter)welfordGetStddev, NULL,
+	  (char *)"The population standard deviation", NULL },
+	{ NULL, NULL, NULL, NULL, NULL }
+};
+
+/**
+ * Minimum and maximum, decaying towards the latest value
+ */
+typedef struct {
+	PyObject_HEAD
+	double		decay;
+	double		min;
+	double		max;
+	long long	count;
+} MinMaxObject;
+
+static PyTypeObject MinMaxType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+};
+
+static int minMaxInit(MinMaxObject* self, PyObject* args, PyObject* kwds)
+{
+	static const char* kwlist[] = { "decay", NULL };
+	self->decay = 0.0;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|d", (char **)kwlist, &self->decay))
+	{
+		return -1;
+	}
+	if (!(self->decay >= 0.0 && self->decay <= 1.0))
+	{
+		PyErr_SetString(PyExc_ValueError, "decay must be in [0, 1]");
+		return -1;
+	}
+	self->count = 0;
+	return 0;
+}
+
+/**
+ * Add a value: the extremes first move towards it by the decay
+ * fraction of their distance to it
+ */
+static PyObject* minMaxUpdate(MinMaxObject* self, PyObject* arg)
+{
+	double x = PyFloat_AsDouble(arg);
+	if (x == -1.0 && PyErr_Occurred())
+	{
+		return NULL;
+	}
+	if (self->count++)
+	{
+		self->max = x + (self->max - x) * (1.0 - self->decay);
+		self->min = x + (self->min - x) * (1.0 - self->decay);
+		if (x > self->max)
+		{
+			self->max = x;
+		}
+		if (x < self->min)
+		{
+			self->min = x;
+		}
+	}
+	else
+	{
+		self->min = self->max = x;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject* minMaxReset(MinMaxObject* self, PyObject* unused)
+{
+	self->count = 0;
+	Py_RETURN_NONE;
+}
+
+static PyObject* minMaxGetMin(MinMaxObject* self, void* closure)
+{
+	return optionalValue(self->count, self->min);
+}
+
+static PyObject* minMaxGetMax(MinMaxObject* self, void* closure)
+{
+	return optionalValue(self->count, self->max);
+}
+
+static PyObject* minMaxReduce(MinMaxObject* self, PyObject* unused)
+{
+	return Py_BuildValue("O(d)(ddL)", Py_TYPE(self), self->decay,
+			     self->min, self->max, self->count);
+}
+
+static PyObject* minMaxSetState(MinMaxObject* self, PyObject* state)
+{
+	if (!PyArg_ParseTuple(state, "ddL", &self->min, &self->max, &self->count))
+	{
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef minMaxMethods[] = {
+	{ "update", (PyCFunction)minMaxUpdate, METH_O, "Add a value" },
+	{ "reset", (PyCFunction)minMaxReset, METH_NOARGS, "Remove all values" },
+	{ "__reduce__", (PyCFunction)minMaxReduce, METH_NOARGS, NULL },
+	{ "__setstate__", (PyCFunction)minMaxSetState, METH_O, NULL },
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyMemberDef minMaxMembers[] = {
+	{ (char *)"decay", T_DOUBLE, offsetof(MinMaxObject, decay), READONLY, NULL },
+	{ (char *)"count", T_LONGLONG, offsetof(MinMaxObject, count), READONLY, NULL },
+	{ NULL, 0, 0, 0, NULL }
+};
+
+static PyGetSetDef minMaxGetSet[] = {
+	{ (char *)"min", (getter)minMaxGetMin, NULL,
+	  (char *)"The minimum, None without values", NULL },
+	{ (char *)"max", (getter)minMaxGetMax, NULL,
+	  (char *)"The maximum, None without values", NULL },
+	{ NULL, NULL, NULL, NULL, NULL }
+};
+
+/**
+ * Quantile sketch: values are counted in buckets of exponentially
+ * growing width, so that quantiles are returned with a relative
+ * accuracy. Sketches with the same accuracy can be merged.
+ */
+typedef struct {
+	PyObject_HEAD
+	double		accuracy;
+	double		gamma;
+	double		logGamma;
+	Py_ssize_t	maxBins;
+	// Counts by bucket index of the positive and negative values
+	map<int, double>*
+			positive;
+	map<int, double>*
+			negative;
+	double		zero;
+	long long	count;
+	double		min;
+	double		max;
+} SketchObject;
+
+static PyTypeObject SketchType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+};
+
+static PyObject* sketchNew(PyTypeObject* type, PyObject* args, PyObject* kwds)
+{
+	SketchObject* self = (SketchObject *)type->tp_alloc(type, 0);
+	if (self)
+	{
+		self->positive = new map<int, double>();
+		self->negative = new map<int, double>();
+		// Usable even if __init__ is not called
+		self->accuracy = SKETCH_ACCURACY;
+		self->gamma = (1.0 + self->accuracy) / (1.0 - self->accuracy);
+		self->logGamma = log(self->gamma);
+		self->maxBins = SKETCH_MAX_BINS;
+	}
+	return (PyObject *)self;
+}
+
+static void sketchDealloc(SketchObject* self)
+{
+	delete self->positive;
+	delete self->negative;
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int sketchInit(SketchObject* self, PyObject* args, PyObject* kwds)
+{
+	static const char* kwlist[] = { "accuracy", "max_bins", NULL };
+	double accuracy = SKETCH_ACCURACY;
+	Py_ssize_t maxBins = SKETCH_MAX_BINS;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|dn", (char **)kwlist,
+					 &accuracy, &maxBins))
+	{
+		return -1;
+	}
+	if (!(accuracy >= SKETCH_MIN_ACCURACY && accuracy < 1.0) || maxBins < 1)
+	{
+		PyErr_SetString(PyExc_ValueError,
+				"accuracy must be in [1e-6, 1) and max_bins positive");
+		return -1;
+	}
+	self->accuracy = accuracy;
+	self->maxBins = maxBins;
+	self->gamma = (1.0 + self->accuracy) / (1.0 - self->accuracy);
+	self->logGamma = log(self->gamma);
+	self->positive->clear();
+	self->negative->clear();
+	self->zero = 0.0;
+	self->count = 0;
+	return 0;
+}
+
+/**
+ * Merge the lowest buckets of a sign while there are too many
+ */
+static void sketchCollapse(SketchObject* self, map<int, double>* bins)
+{
+	while ((Py_ssize_t)bins->size() > self->maxBins)
+	{
+		auto lowest = bins->begin();
+		double count = lowest->second;
+		bins->erase(lowest);
+		bins->begin()->second += count;
+	}
+}
+
+static void sketchAdd(SketchObject* self, double x, double count)
+{
+	if (fabs(x) < SKETCH_MIN_VALUE)
+	{
+		self->zero += count;
+	}
+	else
+	{
+		map<int, double>* bins = x > 0 ? self->positive : self->negative;
+		(*bins)[(int)ceil(log(fabs(x)) / self->logGamma)] += count;
+		sketchCollapse(self, bins);
+	}
+}
+
+static PyObject* sketchUpdate(SketchObject* self, PyObject* arg)
+{
+	double x = PyFloat_AsDouble(arg);
+	if (x == -1.0 && PyErr_Occurred())
+	{
+		return NULL;
+	}
+	if (!isfinite(x))
+	{
+		PyErr_SetString(PyExc_ValueError,
+				"Only finite values can be added");
+		return NULL;
+	}
+	sketchAdd(self, x, 1.0);
+	if (!self->count++ || x < self->min)
+	{
+		self->min = x;
+	}
+	if (self->count == 1 || x > self->max)
+	{
+		self->max = x;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject* sketchMerge(SketchObject* self, PyObject* arg)
+{
+	if (Py_TYPE(arg) != &SketchType ||
+	    ((SketchObject *)arg)->gamma != self->gamma)
+	{
+		PyErr_SetString(PyExc_ValueError,
+				"Only a QuantileSketch of the same accuracy can be merged");
+		return NULL;
+	}
+	SketchObject* other = (SketchObject *)arg;
+	if (!other->count)
+	{
+		Py_RETURN_NONE;
+	}
+	for (auto it = other->positive->begin(); it != other->positive->end(); ++it)
+	{
+		(*self->positive)[it->first] += it->second;
+	}
+	for (auto it = other->negative->begin(); it != other->negative->end(); ++it)
+	{
+		(*self->negative)[it->first] += it->second;
+	}
+	sketchCollapse(self, self->positive);
+	sketchCollapse(self, self->negative);
+	self->zero += other->zero;
+	if (!self->count || other->min < self->min)
+	{
+		self->min = other->min;
+	}
+	if (!self->count || other->max > self->max)
+	{
+		self->max = other->max;
+	}
+	self->count += other->count;
+	Py_RETURN_NONE;
+}
+
+/**
+ * Return the estimated value of a quantile
+ */
+static PyObject* sketchQuantile(SketchObject* self, PyObject* arg)
+{
+	double q = PyFloat_AsDouble(arg);
+	if (q == -1.0 && PyErr_Occurred())
+	{
+		return NULL;
+	}
+	if (!(q >= 0.0 && q <= 1.0))
+	{
+		PyErr_SetString(PyExc_ValueError, "The quantile must be in [0, 1]");
+		return NULL;
+	}
+	if (!self->count)
+	{
+		Py_RETURN_NONE;
+	}
+
+	double rank = q * (self->count - 1);
+	double seen = 0.0;
+	double value = self->max;
+	bool found = false;
+
+	// Negative values, most negative first
+	for (auto it = self->negative->rbegin(); !found && it != self->negative->rend(); ++it)
+	{
+		seen += it->second;
+		if (seen > rank)
+		{
+			value = -2.0 * pow(self->gamma, it->first) / (self->gamma + 1.0);
+			found = true;
+		}
+	}
+	if (!found && (seen += self->zero) > rank)
+	{
+		value = 0.0;
+		found = true;
+	}
+	for (auto it = self->positive->begin(); !found && it != self->positive->end(); ++it)
+	{
+		seen += it->second;
+		if (seen > rank)
+		{
+			value = 2.0 * pow(self->gamma, it->first) / (self->gamma + 1.0);
+			found = true;
+		}
+	}
+
+	if (value < self->min)
+	{
+		value = self->min;
+	}
+	if (value > self->max)
+	{
+		value = self->max;
+	}
+	return PyFloat_FromDouble(value);
+}
+
+static PyObject* sketchReset(SketchObject* self, PyObject* unused)
+{
+	self->positive->clear();
+	self->negative->clear();
+	self->zero = 0.0;
+	self->count = 0;
+	Py_RETURN_NONE;
+}
+
+static PyObject* sketchGetMin(SketchObject* self, void* closure)
+{
+	return optionalValue(self->count, self->min);
+}
+
+static PyObject* sketchGetMax(SketchObject* self, void* closure)
+{
+	return optionalValue(self->count, self->max);
+}
+
+/**
+ * Return a dict of the counts of the buckets of a sign
+ */
+static PyObject* sketchBins(map<int, double>* bins)
+{
+	PyObject* dict = PyDict_New();
+	for (auto it = bins->begin(); dict && it != bins->end(); ++it)
+	{
+		PyObject* index = PyLong_FromLong(it->first);
+		PyObject* count = PyFloat_FromDouble(it->second);
+		if (!index || !count || PyDict_SetItem(dict, index, count) < 0)
+		{
+			Py_CLEAR(dict);
+		}
+		Py_XDECREF(index);
+		Py_XDECREF(count);
+	}
+	return dict;
+}
+
+/**
+ * Set the buckets of a sign from a dict of counts
+ */
+static bool sketchSetBins(map<int, double>* bins, PyObject* dict)
+{
+	if (!PyDict_Check(dict))
+	{
+		PyErr_SetString(PyExc_TypeError, "The buckets must be a dict");
+		return false;
+	}
+	bins->clear();
+	Py_ssize_t pos = 0;
+	PyObject* index;
+	PyObject* count;
+	while (PyDict_Next(dict, &pos, &index, &count))
+	{
+		long i = PyLong_AsLong(index);
+		double c = PyFloat_AsDouble(count);
+		if (PyErr_Occurred())
+		{
+			return false;
+		}
+		(*bins)[(int)i] = c;
+	}
+	return true;
+}
+
+static PyObject* sketchReduce(SketchObject* self, PyObject* unused)
+{
+	PyObject* positive = sketchBins(self->positive);
+	PyObject* negative = sketchBins(self->negative);
+	PyObject* reduced = NULL;
+	if (positive && negative)
+	{
+		reduced = Py_BuildValue("O(dn)(dLddOO)", Py_TYPE(self),
+					self->accuracy, self->maxBins,
+					self->zero, self->count,
+					self->min, self->max,
+					positive, negative);
+	}
+	Py_XDECREF(positive);
+	Py_XDECREF(negative);
+	return reduced;
+}
+
+static PyObject* sketchSetState(SketchObject* self, PyObject* state)
+{
+	PyObject* positive;
+	PyObject* negative;
+	if (!PyArg_ParseTuple(state, "dLddOO", &self->zero, &self->count,
+			      &self->min, &self->max, &positive, &negative) ||
+	    !sketchSetBins(self->positive, positive) ||
+	    !sketchSetBins(self->negative, negative))
+	{
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef sketchMethods[] = {
+	{ "update", (PyCFunction)sketchUpdate, METH_O, "Add a value" },
+	{ "merge", (PyCFunction)sketchMerge, METH_O, "Add the values of another sketch" },
+	{ "quantile", (PyCFunction)sketchQuantile, METH_O, "Return the value of a quantile" },
+	{ "reset", (PyCFunction)sketchReset, METH_NOARGS, "Remove all values" },
+	{ "__reduce__", (PyCFunction)sketchReduce, METH_NOARGS, NULL },
+	{ "__setstate__", (PyCFunction)sketchSetState, METH_O, NULL },
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyMemberDef sketchMembers[] = {
+	{ (char *)"accuracy", T_DOUBLE, offsetof(SketchObject, accuracy), READONLY, NULL },
+	{ (char *)"count", T_LONGLONG, offsetof(SketchObject, count), READONLY, NULL },
+	{ NULL, 0, 0, 0, NULL }
+};
+
+static PyGetSetDef sketchGetSet[] = {
+	{ (char *)"min", (getter)sketchGetMin, NULL,
+	  (char *)"The minimum, None without values", NULL },
+	{ (char *)"max", (getter)sketchGetMax, NULL,
+	  (char *)"The maximum, None without values", NULL },
+	{ NULL, NULL, NULL, NULL, NULL }
+};
+
+/**
+ * Set the slots common to the accumulator types
+ */
+static void setType(PyTypeObject& type,
+		    const char* name,
+		    const char* doc,
+		    Py_ssize_t size,
+		    initproc init,
+		    PyMethodDef* methods,
+		    PyMemberDef* members,
+		    PyGetSetDef* getset)
+{
+	type.tp_name = name;
+	type.tp_doc = doc;
+	type.tp_basicsize = size;
+	type.tp_flags = Py_TPFLAGS_DEFAULT;
+	type.tp_new = PyType_GenericNew;
+	type.tp_init = init;
+	type.tp_methods = methods;
+	type.tp_members = members;
+	type.tp_getset = getset;
+}
+
+/**
+ * Create the foglamp_stats module and add it to sys.modules, once
+ *
+ * @return	False if the module cannot be created
+ */
+bool PythonStats::initialise()
+{
+	if (EwmaType.tp_flags & Py_TPFLAGS_READY)
+	{
+		return true;
+	}
+
+	setType(EwmaType, "foglamp_stats.EWMA",
+		"EWMA(alpha): exponentially weighted moving average",
+		sizeof(EwmaObject), (initproc)ewmaInit,
+		ewmaMethods, ewmaMembers, ewmaGetSet);
+	setType(WelfordType, "foglamp_stats.Welford",
+		"Welford(): count, mean and variance of values",
+		sizeof(WelfordObject), (initproc)welfordInit,
+		welfordMethods, welfordMembers, welfordGetSet);
+	setType(MinMaxType, "foglamp_stats.MinMax",
+		"MinMax(decay=0.0): minimum and maximum of values, moving "
+		"towards each new value by the decay fraction",
+		sizeof(MinMaxObject), (initproc)minMaxInit,
+		minMaxMethods, minMaxMembers, minMaxGetSet);
+	setType(SketchType, "foglamp_stats.QuantileSketch",
+		"QuantileSketch(accuracy=0.01, max_bins=2048): quantiles of "
+		"values with a relative accuracy",
+		sizeof(SketchObject), (initproc)sketchInit,
+		sketchMethods, sketchMembers, sketchGetSet);
+	SketchType.tp_new = sketchNew;
+	SketchType.tp_dealloc = (destructor)sketchDealloc;
+
+	if (PyType_Ready(&EwmaType) < 0 ||
+	    PyType_Ready(&WelfordType) < 0 ||
+	    PyType_Ready(&MinMaxType) < 0 ||
+	    PyType_Ready(&SketchType) < 0)
+	{
+		return false;
+	}
+
+	PyObject* module = PyModule_New("foglamp_stats");
+	if (!module)
+	{
+		return false;
+	}
+	PyTypeObject* types[] = { &EwmaType, &WelfordType, &MinMaxType, &SketchType };
+	for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+	{
+		Py_INCREF(types[i]);
+		PyModule_AddObject(module, strrchr(types[i]->tp_name, '.') + 1,
+				   (PyObject *)types[i]);
+	}
+	bool ret = PyDict_SetItemString(PyImport_GetModuleDict(), "foglamp_stats", module) == 0;
+	Py_DECREF(module);
+	return ret;
+}
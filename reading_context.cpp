@@ -0,0 +1,324 @@
+/*
+ * FogLAMP "Simple Python 3.x" filter reading context.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <string>
+#include <vector>
+#include <reading.h>
+#include "python_datapoint.h"
+#include "reading_view.h"
+#include "reading_context.h"
+
+using namespace std;
+
+/**
+ * Destructor: release the Python objects
+ */
+ReadingContext::~ReadingContext()
+{
+	PyGILState_STATE state = PyGILState_Ensure();
+	if (m_view)
+	{
+		ReadingView::release(m_view);
+	}
+	Py_CLEAR(m_view);
+	Py_CLEAR(m_projection);
+	for (auto it = m_originals.begin(); it != m_originals.end(); ++it)
+	{
+		Py_XDECREF(*it);
+	}
+	Py_CLEAR(m_locals);
+	Py_CLEAR(m_assetCode);
+	PyGILState_Release(state);
+}
+
+/**
+ * Prepare the local variables of the Python code for a reading,
+ * reusing the objects of the previous reading when the code has
+ * not kept references to them.
+ *
+ * @param reading	The reading to pass to the code
+ * @param code		The code that will run
+ * @param stringKeys	Datapoint names are str rather than bytes keys
+ * @param arrayViews	Pass array datapoints as memoryviews
+ * @return		Borrowed reference to the local variables dict
+ */
+PyObject* ReadingContext::prepare(Reading* reading,
+				  CachedCode* code,
+				  bool stringKeys,
+				  bool arrayViews)
+{
+	m_reading = reading;
+	m_code = code;
+
+	if (!m_locals || Py_REFCNT(m_locals) != 1)
+	{
+		Py_CLEAR(m_locals);
+		m_locals = PyDict_New();
+	}
+
+	PyObject* current;
+	if (!code->isDynamic(stringKeys))
+	{
+		// Convert only the datapoints the code accesses, into the
+		// dict of the previous reading, emptied by done()
+		m_projected = true;
+		if (!m_projection)
+		{
+			m_projection = PyDict_New();
+		}
+		const vector<string>& names = code->getDatapoints();
+		PyObject* keys = code->getKeys();
+		m_originals.assign(names.size(), NULL);
+		for (size_t i = 0; i < names.size(); i++)
+		{
+			Datapoint* dp = reading->getDatapoint(names[i]);
+			if (!dp)
+			{
+				continue;
+			}
+			PyObject* value = arrayViews ?
+					  m_arrays.toPython(dp, stringKeys) :
+					  PythonDatapoint::toPython(dp->getData(), stringKeys);
+			if (!value)
+			{
+				PyErr_Clear();
+				continue;
+			}
+			PyDict_SetItem(m_projection, PyTuple_GET_ITEM(keys, i), value);
+			m_originals[i] = value;
+		}
+		current = m_projection;
+	}
+	else
+	{
+		m_projected = false;
+		if (m_view)
+		{
+			ReadingView::reset(m_view, reading);
+		}
+		else
+		{
+			m_view = ReadingView::create(reading,
+						     stringKeys,
+						     arrayViews ? &m_arrays : NULL);
+		}
+		current = m_view;
+	}
+	if (PyDict_GetItemString(m_locals, "reading") != current)
+	{
+		PyDict_SetItemString(m_locals, "reading", current);
+	}
+
+	if (!m_assetCode || reading->getAssetName() != m_assetName)
+	{
+		Py_CLEAR(m_assetCode);
+		m_assetName = reading->getAssetName();
+		m_assetCode = PyUnicode_FromStringAndSize(m_assetName.data(),
+							  m_assetName.length());
+	}
+	if (PyDict_GetItemString(m_locals, "asset_code") != m_assetCode)
+	{
+		PyDict_SetItemString(m_locals, "asset_code", m_assetCode);
+	}
+
+	return m_locals;
+}
+
+/**
+ * Check the 'reading' variable is still the object passed to the
+ * code, i.e. the code has not assigned a new dict to it
+ */
+bool ReadingContext::isCurrent()
+{
+	PyObject* current = m_projected ? m_projection : m_view;
+	return PyDict_GetItemString(m_locals, "reading") == current;
+}
+
+/**
+ * Apply the changes made by the code, if any, to the reading
+ *
+ * @return	False with the Python error set if a value
+ *		cannot be converted
+ */
+bool ReadingContext::writeBack()
+{
+	if (m_projected)
+	{
+		return writeBackProjection();
+	}
+	if (!ReadingView::isModified(m_view))
+	{
+		return true;
+	}
+	return ReadingView::writeBack(m_view);
+}
+
+/**
+ * Merge the dict of the datapoints the code accesses into the reading.
+ *
+ * Values the code has replaced, and mutable values it may have
+ * modified in place, are converted, lists with the type of the
+ * datapoint they replace; datapoints it has removed from
+ * the dict are removed from the reading.
+ *
+ * @return	False with the Python error set if a value
+ *		cannot be converted
+ */
+bool ReadingContext::writeBackProjection()
+{
+	const vector<string>& names = m_code->getDatapoints();
+	PyObject* keys = m_code->getKeys();
+
+	// Datapoints of the reading
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		PyObject* original = m_originals[i];
+		if (!original)
+		{
+			continue;
+		}
+		PyObject* value = PyDict_GetItem(m_projection, PyTuple_GET_ITEM(keys, i));
+		if (!value)
+		{
+			m_arrays.remove(m_reading, names[i]);
+			continue;
+		}
+		if (value == original && !PyList_Check(value) && !PyDict_Check(value))
+		{
+			continue;
+		}
+
+		// Lists the code has only read keep their type
+		Datapoint* dp = m_reading->getDatapoint(names[i]);
+		DatapointValue* newValue = PythonDatapoint::toDatapointValue(value,
+							dp ? &dp->getData() : NULL);
+		if (!newValue)
+		{
+			return false;
+		}
+		m_arrays.setValue(m_reading, dp, *newValue);
+		delete newValue;
+	}
+
+	// New datapoints, in the order the code has set them
+	PyObject *key, *value;
+	Py_ssize_t pos = 0;
+	while (PyDict_Next(m_projection, &pos, &key, &value))
+	{
+		for (size_t i = 0; i < names.size(); i++)
+		{
+			if (PyObject_RichCompareBool(PyTuple_GET_ITEM(keys, i), key, Py_EQ) != 1)
+			{
+				continue;
+			}
+			if (!m_originals[i])
+			{
+				DatapointValue* newValue = PythonDatapoint::toDatapointValue(value);
+				if (!newValue)
+				{
+					return false;
+				}
+				m_reading->addDatapoint(PythonDatapoint::newDatapoint(names[i], *newValue));
+				delete newValue;
+			}
+			break;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Remove the variables set by the code from the local variables
+ * kept for the next reading, but 'asset_code' and 'reading' when it
+ * holds the view or the projection dict kept
+ */
+void ReadingContext::clearLocals()
+{
+	PyObject* current = m_projected ? m_projection : m_view;
+	PyObject* reading = PyDict_GetItemString(m_locals, "reading");
+	if (PyDict_Size(m_locals) <= (current && reading == current ? 2 : 1))
+	{
+		return;
+	}
+	PyObject* keys = PyDict_Keys(m_locals);
+	for (Py_ssize_t i = 0; keys && i < PyList_GET_SIZE(keys); i++)
+	{
+		PyObject* key = PyList_GET_ITEM(keys, i);
+		if (PyUnicode_CompareWithASCIIString(key, "asset_code") != 0 &&
+		    (PyUnicode_CompareWithASCIIString(key, "reading") != 0 ||
+		     !current ||
+		     PyDict_GetItem(m_locals, key) != current))
+		{
+			PyDict_DelItem(m_locals, key);
+		}
+	}
+	Py_XDECREF(keys);
+	PyErr_Clear();
+}
+
+/**
+ * Release the objects bound to the reading once the code has run.
+ *
+ * The view or the emptied projection dict and the local variables
+ * are kept for the next reading unless the code holds a reference
+ * to them, or the reading is about to be deleted. Memoryviews of array datapoints the code
+ * holds take ownership of their datapoints.
+ *
+ * @param deleted	True if the reading will be deleted
+ */
+void ReadingContext::done(bool deleted)
+{
+	if (m_projected)
+	{
+		for (auto it = m_originals.begin(); it != m_originals.end(); ++it)
+		{
+			Py_XDECREF(*it);
+		}
+		m_originals.clear();
+		bool projectionInLocals = PyDict_GetItemString(m_locals, "reading") == m_projection;
+		if (Py_REFCNT(m_locals) != 1)
+		{
+			Py_CLEAR(m_locals);
+			projectionInLocals = false;
+		}
+		if (Py_REFCNT(m_projection) != (projectionInLocals ? 2 : 1))
+		{
+			Py_CLEAR(m_projection);
+		}
+		else
+		{
+			// Release the values, memoryviews of arrays included
+			PyDict_Clear(m_projection);
+		}
+	}
+	else
+	{
+		bool viewInLocals = PyDict_GetItemString(m_locals, "reading") == m_view;
+		if (deleted ||
+		    Py_REFCNT(m_locals) != 1 ||
+		    Py_REFCNT(m_view) != (viewInLocals ? 2 : 1))
+		{
+			ReadingView::release(m_view);
+			Py_CLEAR(m_view);
+			Py_CLEAR(m_locals);
+		}
+		else
+		{
+			ReadingView::reset(m_view, NULL);
+		}
+	}
+
+	if (m_locals)
+	{
+		clearLocals();
+	}
+	m_arrays.release(m_reading, deleted);
+}
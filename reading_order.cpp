@@ -0,0 +1,100 @@
+/*
+ * FogLAMP "Simple Python 3.x" filter ordering of readings.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <utility>
+#include <sys/time.h>
+#include <reading.h>
+#include "reading_order.h"
+
+using namespace std;
+
+/**
+ * Return the user timestamp of a reading in microseconds, the time
+ * the join, the decimation and the sort order readings by
+ *
+ * @param reading	The reading
+ * @return		The user timestamp
+ */
+long long ReadingOrder::userTimestamp(Reading* reading)
+{
+	struct timeval tv;
+	reading->getUserTimestamp(&tv);
+	return (long long)tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+/**
+ * Sort the readings of each asset by user timestamp, in place
+ *
+ * @param readings	The readings
+ */
+void ReadingOrder::sort(vector<Reading *>& readings)
+{
+	// Fast path: all the readings are in order
+	long long last = 0;
+	size_t i;
+	for (i = 0; i < readings.size(); i++)
+	{
+		long long time = ReadingOrder::userTimestamp(readings[i]);
+		if (i && time < last)
+		{
+			break;
+		}
+		last = time;
+	}
+	if (i == readings.size())
+	{
+		return;
+	}
+
+	// Timestamps and positions of the readings of each asset
+	unordered_map<string, vector<pair<long long, size_t> > > assets;
+	for (i = 0; i < readings.size(); i++)
+	{
+		assets[readings[i]->getAssetName()].push_back(
+			make_pair(ReadingOrder::userTimestamp(readings[i]), i));
+	}
+
+	vector<Reading *> sorted;
+	for (auto asset = assets.begin(); asset != assets.end(); ++asset)
+	{
+		vector<pair<long long, size_t> >& entries = asset->second;
+		bool inOrder = true;
+		for (size_t j = 1; inOrder && j < entries.size(); j++)
+		{
+			inOrder = entries[j - 1].first <= entries[j].first;
+		}
+		if (inOrder)
+		{
+			continue;
+		}
+
+		// The positions are in order: sort a copy of the entries
+		// and place the readings at the positions of the asset
+		vector<pair<long long, size_t> > byTime(entries);
+		stable_sort(byTime.begin(), byTime.end(),
+			    [](const pair<long long, size_t>& a,
+			       const pair<long long, size_t>& b) {
+				return a.first < b.first;
+			    });
+		sorted.clear();
+		for (auto it = byTime.begin(); it != byTime.end(); ++it)
+		{
+			sorted.push_back(readings[it->second]);
+		}
+		for (size_t j = 0; j < entries.size(); j++)
+		{
+			readings[entries[j].second] = sorted[j];
+		}
+	}
+}
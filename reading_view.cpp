@@ -0,0 +1,1017 @@
+/*
+ * FogLAMP "Simple Python 3.x" filter lazy reading view.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <sys/time.h>
+#include <reading.h>
+#include "python_datapoint.h"
+#include "array_view.h"
+#include "reading_view.h"
+
+using namespace std;
+
+// Maximum number of deallocated views kept for reuse
+#define MAX_FREE_VIEWS	32
+
+/**
+ * The Python object of the view
+ */
+typedef struct {
+	PyObject_HEAD
+	// The wrapped reading, NULL once released
+	Reading*	reading;
+	// Converted and written values, by key
+	PyObject*	values;
+	// Keys of the values to write back
+	PyObject*	written;
+	// Keys of the deleted datapoints
+	PyObject*	deleted;
+	// Datapoint names are str rather than bytes keys
+	bool		stringKeys;
+	// Array datapoints passed as memoryviews, NULL if not
+	ArrayViews*	arrays;
+	// The asset name, created when accessed or set
+	PyObject*	asset;
+	// The asset name has been set by the Python code
+	bool		assetWritten;
+	// Timestamps set by the Python code, in nanoseconds
+	long long	userTs;
+	long long	ts;
+	bool		userTsWritten;
+	bool		tsWritten;
+} ReadingViewObject;
+
+static PyTypeObject ReadingViewType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+};
+
+// Deallocated views, reused by ReadingView::create()
+static ReadingViewObject* freeViews[MAX_FREE_VIEWS];
+static int numFreeViews = 0;
+
+/**
+ * Check the view still wraps a reading
+ */
+static bool viewAttached(ReadingViewObject* self)
+{
+	if (!self->reading)
+	{
+		PyErr_SetString(PyExc_RuntimeError,
+				"The reading is no longer available");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Return the key used in the view dicts for a key passed by
+ * the Python code and the datapoint name.
+ *
+ * @return	New reference to the key, NULL on error
+ */
+static PyObject* viewKey(ReadingViewObject* self, PyObject* key, string& name)
+{
+	if (!PythonDatapoint::keyToName(key, name))
+	{
+		return NULL;
+	}
+	if (self->stringKeys ? PyUnicode_CheckExact(key) : PyBytes_CheckExact(key))
+	{
+		Py_INCREF(key);
+		return key;
+	}
+	return PythonDatapoint::nameToKey(name, self->stringKeys);
+}
+
+/**
+ * Add a key to one of the view sets, creating the set
+ */
+static int viewSetAdd(PyObject** set, PyObject* key)
+{
+	if (!*set && (*set = PySet_New(NULL)) == NULL)
+	{
+		return -1;
+	}
+	return PySet_Add(*set, key);
+}
+
+/**
+ * Check whether a key is in one of the view sets
+ */
+static bool viewSetContains(PyObject* set, PyObject* key)
+{
+	return set && PySet_Contains(set, key) == 1;
+}
+
+/**
+ * Check whether the view has a datapoint
+ */
+static bool viewContains(ReadingViewObject* self, PyObject* key, const string& name)
+{
+	if (self->values && PyDict_GetItem(self->values, key))
+	{
+		return true;
+	}
+	if (viewSetContains(self->deleted, key))
+	{
+		return false;
+	}
+	return self->reading->getDatapoint(name) != NULL;
+}
+
+/**
+ * Return the list of keys of the view: the datapoints of
+ * the reading not deleted followed by the added ones
+ */
+static PyObject* viewKeys(ReadingViewObject* self, PyObject* unused = NULL)
+{
+	if (!viewAttached(self))
+	{
+		return NULL;
+	}
+
+	PyObject* keys = PyList_New(0);
+	vector<Datapoint *>& dps = self->reading->getReadingData();
+	for (auto it = dps.begin(); keys && it != dps.end(); ++it)
+	{
+		PyObject* key = PythonDatapoint::nameToKey((*it)->getName(), self->stringKeys);
+		if (!key || (!viewSetContains(self->deleted, key) &&
+			     PyList_Append(keys, key) < 0))
+		{
+			Py_CLEAR(keys);
+		}
+		Py_CLEAR(key);
+	}
+
+	if (keys && self->written)
+	{
+		PyObject *key, *value;
+		Py_ssize_t pos = 0;
+		while (PyDict_Next(self->values, &pos, &key, &value))
+		{
+			string name;
+			if (viewSetContains(self->written, key) &&
+			    PythonDatapoint::keyToName(key, name) &&
+			    self->reading->getDatapoint(name) == NULL &&
+			    PyList_Append(keys, key) < 0)
+			{
+				Py_CLEAR(keys);
+				break;
+			}
+		}
+	}
+
+	return keys;
+}
+
+/**
+ * Get a value: convert the datapoint on first access
+ */
+static PyObject* viewGetItem(ReadingViewObject* self, PyObject* key)
+{
+	if (!viewAttached(self))
+	{
+		return NULL;
+	}
+
+	string name;
+	PyObject* vkey = viewKey(self, key, name);
+	if (!vkey)
+	{
+		return NULL;
+	}
+
+	PyObject* value = self->values ? PyDict_GetItem(self->values, vkey) : NULL;
+	if (value)
+	{
+		Py_INCREF(value);
+		Py_DECREF(vkey);
+		return value;
+	}
+
+	Datapoint* dp = viewSetContains(self->deleted, vkey) ?
+			NULL :
+			self->reading->getDatapoint(name);
+	if (!dp)
+	{
+		PyErr_SetObject(PyExc_KeyError, key);
+		Py_DECREF(vkey);
+		return NULL;
+	}
+
+	value = self->arrays ?
+		self->arrays->toPython(dp, self->stringKeys) :
+		PythonDatapoint::toPython(dp->getData(), self->stringKeys);
+	if (value)
+	{
+		if ((!self->values && (self->values = PyDict_New()) == NULL) ||
+		    PyDict_SetItem(self->values, vkey, value) < 0 ||
+		    // Mutable values may be modified in place: write them
+		    // back, lists keep their datapoint type
+		    ((PyList_Check(value) || PyDict_Check(value)) &&
+		     viewSetAdd(&self->written, vkey) < 0))
+		{
+			Py_CLEAR(value);
+		}
+	}
+	Py_DECREF(vkey);
+
+	return value;
+}
+
+/**
+ * Set or delete a value, recording the change
+ */
+static int viewSetItem(ReadingViewObject* self, PyObject* key, PyObject* value)
+{
+	if (!viewAttached(self))
+	{
+		return -1;
+	}
+
+	string name;
+	PyObject* vkey = viewKey(self, key, name);
+	if (!vkey)
+	{
+		return -1;
+	}
+
+	int ret = 0;
+	if (value)
+	{
+		if ((!self->values && (self->values = PyDict_New()) == NULL) ||
+		    PyDict_SetItem(self->values, vkey, value) < 0 ||
+		    viewSetAdd(&self->written, vkey) < 0 ||
+		    (self->deleted && PySet_Discard(self->deleted, vkey) < 0))
+		{
+			ret = -1;
+		}
+	}
+	else if (!viewContains(self, vkey, name))
+	{
+		PyErr_SetObject(PyExc_KeyError, key);
+		ret = -1;
+	}
+	else
+	{
+		if (self->values && PyDict_DelItem(self->values, vkey) < 0)
+		{
+			PyErr_Clear();
+		}
+		if ((self->written && PySet_Discard(self->written, vkey) < 0) ||
+		    viewSetAdd(&self->deleted, vkey) < 0)
+		{
+			ret = -1;
+		}
+	}
+	Py_DECREF(vkey);
+
+	return ret;
+}
+
+static Py_ssize_t viewLength(ReadingViewObject* self)
+{
+	PyObject* keys = viewKeys(self);
+	if (!keys)
+	{
+		return -1;
+	}
+	Py_ssize_t length = PyList_GET_SIZE(keys);
+	Py_DECREF(keys);
+	return length;
+}
+
+static int viewSqContains(ReadingViewObject* self, PyObject* key)
+{
+	if (!viewAttached(self))
+	{
+		return -1;
+	}
+	string name;
+	PyObject* vkey = viewKey(self, key, name);
+	if (!vkey)
+	{
+		return -1;
+	}
+	int ret = viewContains(self, vkey, name) ? 1 : 0;
+	Py_DECREF(vkey);
+	return ret;
+}
+
+static PyObject* viewIter(ReadingViewObject* self)
+{
+	PyObject* keys = viewKeys(self);
+	if (!keys)
+	{
+		return NULL;
+	}
+	PyObject* iter = PyObject_GetIter(keys);
+	Py_DECREF(keys);
+	return iter;
+}
+
+/**
+ * Return a new dict with all the keys and values of the view
+ */
+static PyObject* viewCopy(ReadingViewObject* self, PyObject* unused = NULL)
+{
+	PyObject* keys = viewKeys(self);
+	if (!keys)
+	{
+		return NULL;
+	}
+	PyObject* dict = PyDict_New();
+	for (Py_ssize_t i = 0; dict && i < PyList_GET_SIZE(keys); i++)
+	{
+		PyObject* key = PyList_GET_ITEM(keys, i);
+		PyObject* value = viewGetItem(self, key);
+		if (!value || PyDict_SetItem(dict, key, value) < 0)
+		{
+			Py_CLEAR(dict);
+		}
+		Py_XDECREF(value);
+	}
+	Py_DECREF(keys);
+	return dict;
+}
+
+static PyObject* viewValues(ReadingViewObject* self, PyObject* unused)
+{
+	PyObject* dict = viewCopy(self);
+	PyObject* values = dict ? PyDict_Values(dict) : NULL;
+	Py_XDECREF(dict);
+	return values;
+}
+
+static PyObject* viewItems(ReadingViewObject* self, PyObject* unused)
+{
+	PyObject* dict = viewCopy(self);
+	PyObject* items = dict ? PyDict_Items(dict) : NULL;
+	Py_XDECREF(dict);
+	return items;
+}
+
+static PyObject* viewGet(ReadingViewObject* self, PyObject* args)
+{
+	PyObject *key, *def = Py_None;
+	if (!PyArg_UnpackTuple(args, "get", 1, 2, &key, &def))
+	{
+		return NULL;
+	}
+	PyObject* value = viewGetItem(self, key);
+	if (!value && PyErr_ExceptionMatches(PyExc_KeyError))
+	{
+		PyErr_Clear();
+		Py_INCREF(def);
+		value = def;
+	}
+	return value;
+}
+
+static PyObject* viewPop(ReadingViewObject* self, PyObject* args)
+{
+	PyObject *key, *def = NULL;
+	if (!PyArg_UnpackTuple(args, "pop", 1, 2, &key, &def))
+	{
+		return NULL;
+	}
+	PyObject* value = viewGetItem(self, key);
+	if (!value)
+	{
+		if (def && PyErr_ExceptionMatches(PyExc_KeyError))
+		{
+			PyErr_Clear();
+			Py_INCREF(def);
+			return def;
+		}
+		return NULL;
+	}
+	if (viewSetItem(self, key, NULL) < 0)
+	{
+		Py_CLEAR(value);
+	}
+	return value;
+}
+
+static PyObject* viewSetDefault(ReadingViewObject* self, PyObject* args)
+{
+	PyObject *key, *def = Py_None;
+	if (!PyArg_UnpackTuple(args, "setdefault", 1, 2, &key, &def))
+	{
+		return NULL;
+	}
+	PyObject* value = viewGetItem(self, key);
+	if (!value && PyErr_ExceptionMatches(PyExc_KeyError))
+	{
+		PyErr_Clear();
+		if (viewSetItem(self, key, def) < 0)
+		{
+			return NULL;
+		}
+		Py_INCREF(def);
+		value = def;
+	}
+	return value;
+}
+
+static PyObject* viewUpdate(ReadingViewObject* self, PyObject* other)
+{
+	PyObject* dict = PyDict_New();
+	if (!dict)
+	{
+		return NULL;
+	}
+	int ret = PyObject_HasAttrString(other, "keys") ?
+		  PyDict_Merge(dict, other, 1) :
+		  PyDict_MergeFromSeq2(dict, other, 1);
+	PyObject *key, *value;
+	Py_ssize_t pos = 0;
+	while (ret == 0 && PyDict_Next(dict, &pos, &key, &value))
+	{
+		ret = viewSetItem(self, key, value);
+	}
+	Py_DECREF(dict);
+	if (ret < 0)
+	{
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject* viewRepr(ReadingViewObject* self)
+{
+	PyObject* dict = viewCopy(self);
+	PyObject* repr = dict ? PyObject_Repr(dict) : NULL;
+	Py_XDECREF(dict);
+	return repr;
+}
+
+/**
+ * The 'asset' attribute: the asset name of the reading
+ */
+static PyObject* viewGetAsset(ReadingViewObject* self, void* closure)
+{
+	if (!viewAttached(self))
+	{
+		return NULL;
+	}
+	if (!self->asset)
+	{
+		const string& name = self->reading->getAssetName();
+		self->asset = PyUnicode_FromStringAndSize(name.data(), name.length());
+	}
+	Py_XINCREF(self->asset);
+	return self->asset;
+}
+
+static int viewSetAsset(ReadingViewObject* self, PyObject* value, void* closure)
+{
+	if (!viewAttached(self))
+	{
+		return -1;
+	}
+	if (!value || !PyUnicode_Check(value))
+	{
+		PyErr_SetString(PyExc_TypeError, "The asset name must be a str");
+		return -1;
+	}
+	if (!PyUnicode_AsUTF8(value))
+	{
+		return -1;
+	}
+	Py_INCREF(value);
+	Py_XSETREF(self->asset, value);
+	self->assetWritten = true;
+	return 0;
+}
+
+/**
+ * Convert a timeval into nanoseconds since the epoch
+ */
+static long long timevalToNs(const struct timeval& tv)
+{
+	return (long long)tv.tv_sec * 1000000000LL + (long long)tv.tv_usec * 1000LL;
+}
+
+/**
+ * Convert nanoseconds since the epoch into a timeval,
+ * the precision of which is the microsecond
+ */
+static struct timeval nsToTimeval(long long ns)
+{
+	struct timeval tv;
+	long long usec = ns / 1000LL;
+	if (ns % 1000LL < 0)
+	{
+		usec--;
+	}
+	tv.tv_sec = usec / 1000000LL;
+	tv.tv_usec = usec % 1000000LL;
+	if (tv.tv_usec < 0)
+	{
+		tv.tv_sec--;
+		tv.tv_usec += 1000000;
+	}
+	return tv;
+}
+
+/**
+ * Get a timestamp attribute: the value set by the Python code
+ * or the timestamp of the reading
+ */
+static PyObject* viewGetTimestamp(ReadingViewObject* self, void* closure)
+{
+	if (!viewAttached(self))
+	{
+		return NULL;
+	}
+	bool user = closure != NULL;
+	if (user ? self->userTsWritten : self->tsWritten)
+	{
+		return PyLong_FromLongLong(user ? self->userTs : self->ts);
+	}
+	struct timeval tv;
+	if (user)
+	{
+		self->reading->getUserTimestamp(&tv);
+	}
+	else
+	{
+		self->reading->getTimestamp(&tv);
+	}
+	return PyLong_FromLongLong(timevalToNs(tv));
+}
+
+/**
+ * Set a timestamp attribute, an int of nanoseconds since the epoch
+ */
+static int viewSetTimestamp(ReadingViewObject* self, PyObject* value, void* closure)
+{
+	if (!viewAttached(self))
+	{
+		return -1;
+	}
+	if (!value || !PyLong_Check(value))
+	{
+		PyErr_SetString(PyExc_TypeError,
+				"Timestamps must be int nanoseconds since the epoch");
+		return -1;
+	}
+	long long ns = PyLong_AsLongLong(value);
+	if (ns == -1 && PyErr_Occurred())
+	{
+		return -1;
+	}
+	if (closure)
+	{
+		self->userTs = ns;
+		self->userTsWritten = true;
+	}
+	else
+	{
+		self->ts = ns;
+		self->tsWritten = true;
+	}
+	return 0;
+}
+
+/**
+ * The 'datapoints' attribute: the mapping of the datapoints,
+ * which is the reading itself
+ */
+static PyObject* viewGetDatapoints(ReadingViewObject* self, void* closure)
+{
+	if (!viewAttached(self))
+	{
+		return NULL;
+	}
+	Py_INCREF(self);
+	return (PyObject *)self;
+}
+
+static int viewTraverse(ReadingViewObject* self, visitproc visit, void* arg)
+{
+	Py_VISIT(self->asset);
+	Py_VISIT(self->values);
+	Py_VISIT(self->written);
+	Py_VISIT(self->deleted);
+	return 0;
+}
+
+static int viewClear(ReadingViewObject* self)
+{
+	Py_CLEAR(self->asset);
+	Py_CLEAR(self->values);
+	Py_CLEAR(self->written);
+	Py_CLEAR(self->deleted);
+	return 0;
+}
+
+/**
+ * Deallocate a view: keep its memory for the next view created
+ */
+static void viewDealloc(ReadingViewObject* self)
+{
+	PyObject_GC_UnTrack(self);
+	viewClear(self);
+	if (numFreeViews < MAX_FREE_VIEWS)
+	{
+		freeViews[numFreeViews++] = self;
+	}
+	else
+	{
+		Py_TYPE(self)->tp_free((PyObject *)self);
+	}
+}
+
+static PyMappingMethods viewMapping = {
+	(lenfunc)viewLength,
+	(binaryfunc)viewGetItem,
+	(objobjargproc)viewSetItem
+};
+
+static PySequenceMethods viewSequence;
+
+static PyMethodDef viewMethods[] = {
+	{ "keys", (PyCFunction)viewKeys, METH_NOARGS, "List of the datapoint names" },
+	{ "values", (PyCFunction)viewValues, METH_NOARGS, "List of the datapoint values" },
+	{ "items", (PyCFunction)viewItems, METH_NOARGS, "List of the (name, value) pairs" },
+	{ "get", (PyCFunction)viewGet, METH_VARARGS, "Return a value or a default" },
+	{ "pop", (PyCFunction)viewPop, METH_VARARGS, "Remove a datapoint and return its value" },
+	{ "setdefault", (PyCFunction)viewSetDefault, METH_VARARGS, "Return a value, setting it if missing" },
+	{ "update", (PyCFunction)viewUpdate, METH_O, "Set values from a dict" },
+	{ "copy", (PyCFunction)viewCopy, METH_NOARGS, "Return a dict copy of the reading" },
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyGetSetDef viewGetSet[] = {
+	{ (char *)"asset", (getter)viewGetAsset, (setter)viewSetAsset,
+	  (char *)"The asset name", NULL },
+	{ (char *)"user_ts", (getter)viewGetTimestamp, (setter)viewSetTimestamp,
+	  (char *)"The user timestamp in nanoseconds since the epoch", (void *)1 },
+	{ (char *)"ts", (getter)viewGetTimestamp, (setter)viewSetTimestamp,
+	  (char *)"The timestamp in nanoseconds since the epoch", NULL },
+	{ (char *)"datapoints", (getter)viewGetDatapoints, NULL,
+	  (char *)"The mapping of the datapoints", NULL },
+	{ NULL, NULL, NULL, NULL, NULL }
+};
+
+/**
+ * Initialise the Python type of the view, once.
+ *
+ * The type is the Reading type of the foglamp_reading module, which
+ * is added to sys.modules so that the Python code can import it.
+ * It is registered as a collections.abc.MutableMapping
+ *
+ * @return	False if the type cannot be created
+ */
+bool ReadingView::initialise()
+{
+	if (ReadingViewType.tp_flags & Py_TPFLAGS_READY)
+	{
+		return true;
+	}
+
+	viewSequence.sq_contains = (objobjproc)viewSqContains;
+
+	ReadingViewType.tp_name = "foglamp_reading.Reading";
+	ReadingViewType.tp_doc = "A FogLAMP reading: a mapping of its datapoints";
+	ReadingViewType.tp_basicsize = sizeof(ReadingViewObject);
+	ReadingViewType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC;
+	ReadingViewType.tp_dealloc = (destructor)viewDealloc;
+	ReadingViewType.tp_traverse = (traverseproc)viewTraverse;
+	ReadingViewType.tp_clear = (inquiry)viewClear;
+	ReadingViewType.tp_repr = (reprfunc)viewRepr;
+	ReadingViewType.tp_as_mapping = &viewMapping;
+	ReadingViewType.tp_as_sequence = &viewSequence;
+	ReadingViewType.tp_iter = (getiterfunc)viewIter;
+	ReadingViewType.tp_methods = viewMethods;
+	ReadingViewType.tp_getset = viewGetSet;
+	ReadingViewType.tp_hash = PyObject_HashNotImplemented;
+
+	if (PyType_Ready(&ReadingViewType) < 0)
+	{
+		return false;
+	}
+
+	PyObject* module = PyModule_New("foglamp_reading");
+	Py_INCREF(&ReadingViewType);
+	if (!module ||
+	    PyModule_AddObject(module, "Reading", (PyObject *)&ReadingViewType) < 0 ||
+	    PyDict_SetItemString(PyImport_GetModuleDict(), "foglamp_reading", module) < 0)
+	{
+		PyErr_Clear();
+	}
+	Py_XDECREF(module);
+
+	PyObject* abc = PyImport_ImportModule("collections.abc");
+	PyObject* mapping = abc ? PyObject_GetAttrString(abc, "MutableMapping") : NULL;
+	PyObject* res = mapping ?
+			PyObject_CallMethod(mapping, "register", "O",
+					    (PyObject *)&ReadingViewType) :
+			NULL;
+	Py_XDECREF(res);
+	Py_XDECREF(mapping);
+	Py_XDECREF(abc);
+	PyErr_Clear();
+
+	return true;
+}
+
+/**
+ * Check whether all the datapoints of a reading can be
+ * accessed through a view
+ *
+ * @param reading	The reading
+ * @return		True if supported
+ */
+bool ReadingView::isSupported(Reading* reading)
+{
+	vector<Datapoint *>& dps = reading->getReadingData();
+	for (auto it = dps.begin(); it != dps.end(); ++it)
+	{
+		if (!PythonDatapoint::isSupported((*it)->getData()))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Create a view of a reading. The reading must outlive the
+ * view or the view must be released first.
+ *
+ * @param reading	The reading
+ * @param stringKeys	Datapoint names are str rather than bytes keys
+ * @param arrays	The views of the array datapoints, NULL to
+ *			pass array datapoints as lists
+ * @return		New reference to the view, NULL on error
+ */
+PyObject* ReadingView::create(Reading* reading, bool stringKeys, ArrayViews* arrays)
+{
+	ReadingViewObject* self;
+	if (numFreeViews)
+	{
+		self = freeViews[--numFreeViews];
+		PyObject_Init((PyObject *)self, &ReadingViewType);
+	}
+	else
+	{
+		self = PyObject_GC_New(ReadingViewObject, &ReadingViewType);
+		if (!self)
+		{
+			return NULL;
+		}
+	}
+	self->reading = reading;
+	self->values = NULL;
+	self->written = NULL;
+	self->deleted = NULL;
+	self->stringKeys = stringKeys;
+	self->arrays = arrays;
+	self->asset = NULL;
+	self->assetWritten = false;
+	self->userTsWritten = false;
+	self->tsWritten = false;
+	PyObject_GC_Track(self);
+
+	return (PyObject *)self;
+}
+
+/**
+ * Check whether a Python object is a view
+ */
+bool ReadingView::check(PyObject* object)
+{
+	return Py_TYPE(object) == &ReadingViewType;
+}
+
+/**
+ * Make a view wrap another reading, clearing the values
+ * converted for the previous one
+ *
+ * @param view		The view
+ * @param reading	The new reading, NULL to only clear the values
+ */
+void ReadingView::reset(PyObject* view, Reading* reading)
+{
+	ReadingViewObject* self = (ReadingViewObject *)view;
+	self->reading = reading;
+	Py_CLEAR(self->asset);
+	self->assetWritten = false;
+	self->userTsWritten = false;
+	self->tsWritten = false;
+	if (self->values)
+	{
+		PyDict_Clear(self->values);
+	}
+	if (self->written)
+	{
+		PySet_Clear(self->written);
+	}
+	if (self->deleted)
+	{
+		PySet_Clear(self->deleted);
+	}
+}
+
+/**
+ * Check whether the Python code has set or deleted datapoints,
+ * including values that may have been modified in place, or
+ * has set the asset name or the timestamps
+ *
+ * @param view		The view
+ * @return		True if the reading needs to be written back
+ */
+bool ReadingView::isModified(PyObject* view)
+{
+	ReadingViewObject* self = (ReadingViewObject *)view;
+	return self->assetWritten ||
+	       self->userTsWritten ||
+	       self->tsWritten ||
+	       (self->written && PySet_GET_SIZE(self->written)) ||
+	       (self->deleted && PySet_GET_SIZE(self->deleted));
+}
+
+/**
+ * Apply the values written, the datapoints deleted, the asset
+ * name and the timestamps set by the Python code to the reading
+ * of the view.
+ *
+ * All written values are converted before the reading is changed,
+ * on a conversion error the reading is left unchanged.
+ *
+ * @param view		The view
+ * @return		False with the Python error set if a
+ *			written value cannot be converted
+ */
+bool ReadingView::writeBack(PyObject* view)
+{
+	ReadingViewObject* self = (ReadingViewObject *)view;
+	if (!viewAttached(self))
+	{
+		return false;
+	}
+
+	vector<pair<string, DatapointValue *> > changes;
+	if (self->written)
+	{
+		PyObject* iter = PyObject_GetIter(self->written);
+		PyObject* key;
+		while (iter && (key = PyIter_Next(iter)) != NULL)
+		{
+			string name;
+			PythonDatapoint::keyToName(key, name);
+			// Lists read by the code keep their type
+			Datapoint* dp = self->reading->getDatapoint(name);
+			DatapointValue* value = PythonDatapoint::toDatapointValue(
+						PyDict_GetItem(self->values, key),
+						dp ? &dp->getData() : NULL);
+			Py_DECREF(key);
+			if (!value)
+			{
+				break;
+			}
+			changes.push_back(make_pair(name, value));
+		}
+		Py_XDECREF(iter);
+
+		if (PyErr_Occurred())
+		{
+			for (auto it = changes.begin(); it != changes.end(); ++it)
+			{
+				delete it->second;
+			}
+			return false;
+		}
+	}
+
+	Reading* reading = self->reading;
+	for (auto it = changes.begin(); it != changes.end(); ++it)
+	{
+		Datapoint* dp = reading->getDatapoint(it->first);
+		if (dp && self->arrays)
+		{
+			self->arrays->setValue(reading, dp, *(it->second));
+		}
+		else if (dp)
+		{
+			PythonDatapoint::setValue(dp->getData(), *(it->second));
+		}
+		else
+		{
+			reading->addDatapoint(PythonDatapoint::newDatapoint(it->first,
+									    *(it->second)));
+		}
+		delete it->second;
+	}
+
+	if (self->deleted)
+	{
+		PyObject* iter = PyObject_GetIter(self->deleted);
+		PyObject* key;
+		while (iter && (key = PyIter_Next(iter)) != NULL)
+		{
+			string name;
+			PythonDatapoint::keyToName(key, name);
+			if (self->arrays)
+			{
+				self->arrays->remove(reading, name);
+			}
+			else
+			{
+				delete reading->removeDatapoint(name);
+			}
+			Py_DECREF(key);
+		}
+		Py_XDECREF(iter);
+	}
+
+	if (self->assetWritten)
+	{
+		reading->setAssetName(PyUnicode_AsUTF8(self->asset));
+	}
+	copyTimestamps(view, reading);
+
+	return true;
+}
+
+/**
+ * Set the timestamps of a reading to the timestamps of a view:
+ * the ones set by the Python code, otherwise the timestamps of
+ * the reading of the view
+ *
+ * @param view		The view
+ * @param reading	The reading to update
+ */
+void ReadingView::copyTimestamps(PyObject* view, Reading* reading)
+{
+	ReadingViewObject* self = (ReadingViewObject *)view;
+	if (self->userTsWritten)
+	{
+		reading->setUserTimestamp(nsToTimeval(self->userTs));
+	}
+	else if (self->reading && reading != self->reading)
+	{
+		struct timeval tv;
+		self->reading->getUserTimestamp(&tv);
+		reading->setUserTimestamp(tv);
+	}
+	if (self->tsWritten)
+	{
+		reading->setTimestamp(nsToTimeval(self->ts));
+	}
+	else if (self->reading && reading != self->reading)
+	{
+		struct timeval tv;
+		self->reading->getTimestamp(&tv);
+		reading->setTimestamp(tv);
+	}
+}
+
+/**
+ * Detach a view from its reading: the Python code may have
+ * kept a reference to it, later accesses raise an error.
+ *
+ * @param view		The view
+ */
+void ReadingView::release(PyObject* view)
+{
+	ReadingViewObject* self = (ReadingViewObject *)view;
+	self->reading = NULL;
+	viewClear(self);
+}
+
+/**
+ * Return the asset name set by the Python code
+ *
+ * @param view		The view
+ * @return		Borrowed reference to the asset name,
+ *			NULL if not set
+ */
+PyObject* ReadingView::getAssetWritten(PyObject* view)
+{
+	ReadingViewObject* self = (ReadingViewObject *)view;
+	return self->assetWritten ? self->asset : NULL;
+}
+
+/**
+ * Return a new dict with the datapoints of the view
+ *
+ * @param view		The view
+ * @return		New reference to the dict, NULL on error
+ */
+PyObject* ReadingView::toDict(PyObject* view)
+{
+	return viewCopy((ReadingViewObject *)view);
+}
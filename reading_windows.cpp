@@ -0,0 +1,431 @@
+/*
+ * FogLAMP "Simple Python 3.x" filter sliding windows of datapoints.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <string>
+#include <vector>
+#include <sys/time.h>
+#include <reading.h>
+#include "python_datapoint.h"
+#include "reading_windows.h"
+#include "json_config.h"
+
+using namespace std;
+
+/**
+ * The Python object of a window.
+ *
+ * Values are written twice, at head and at head + capacity, so that
+ * the last count values always lie contiguously before head + capacity.
+ */
+typedef struct {
+	PyObject_HEAD
+	// Maximum number of values
+	Py_ssize_t	capacity;
+	// Index of the next value to write, less than capacity
+	Py_ssize_t	head;
+	// Number of values
+	Py_ssize_t	count;
+	// Values and timestamps, 2 * capacity items
+	double*		values;
+	long long*	timestamps;
+} WindowObject;
+
+/**
+ * The Python object exporting the values or the timestamps
+ * of a window
+ */
+typedef struct {
+	PyObject_HEAD
+	WindowObject*	window;
+	bool		timestamps;
+	Py_ssize_t	shape;
+} WindowBufferObject;
+
+static PyTypeObject WindowType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+};
+
+static PyTypeObject WindowBufferType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+};
+
+/**
+ * Create a window
+ *
+ * @param capacity	The number of values of the window
+ * @return		New reference to the window, NULL on error
+ */
+static PyObject* windowNew(Py_ssize_t capacity)
+{
+	WindowObject* self = PyObject_New(WindowObject, &WindowType);
+	if (!self)
+	{
+		return NULL;
+	}
+	self->capacity = capacity;
+	self->head = 0;
+	self->count = 0;
+	self->values = PyMem_New(double, 2 * capacity);
+	self->timestamps = PyMem_New(long long, 2 * capacity);
+	if (!self->values || !self->timestamps)
+	{
+		Py_DECREF(self);
+		return PyErr_NoMemory();
+	}
+	return (PyObject *)self;
+}
+
+/**
+ * Add a value to a window, replacing the oldest one if full
+ */
+static void windowPush(WindowObject* self, double value, long long timestamp)
+{
+	self->values[self->head] = value;
+	self->values[self->head + self->capacity] = value;
+	self->timestamps[self->head] = timestamp;
+	self->timestamps[self->head + self->capacity] = timestamp;
+	if (++self->head == self->capacity)
+	{
+		self->head = 0;
+	}
+	if (self->count < self->capacity)
+	{
+		self->count++;
+	}
+}
+
+static void windowDealloc(WindowObject* self)
+{
+	PyMem_Free(self->values);
+	PyMem_Free(self->timestamps);
+	PyObject_Del(self);
+}
+
+static Py_ssize_t windowLength(WindowObject* self)
+{
+	return self->count;
+}
+
+static PyObject* windowRepr(WindowObject* self)
+{
+	return PyUnicode_FromFormat("<Window %zd/%zd>", self->count, self->capacity);
+}
+
+/**
+ * Return a memoryview of the values or the timestamps of a window
+ */
+static PyObject* windowView(WindowObject* self, bool timestamps)
+{
+	WindowBufferObject* buffer = PyObject_New(WindowBufferObject, &WindowBufferType);
+	if (!buffer)
+	{
+		return NULL;
+	}
+	Py_INCREF(self);
+	buffer->window = self;
+	buffer->timestamps = timestamps;
+	buffer->shape = 0;
+	PyObject* view = PyMemoryView_FromObject((PyObject *)buffer);
+	Py_DECREF(buffer);
+	return view;
+}
+
+static PyObject* windowGetValues(WindowObject* self, void* closure)
+{
+	return windowView(self, false);
+}
+
+static PyObject* windowGetTimestamps(WindowObject* self, void* closure)
+{
+	return windowView(self, true);
+}
+
+static PyObject* windowGetCapacity(WindowObject* self, void* closure)
+{
+	return PyLong_FromSsize_t(self->capacity);
+}
+
+/**
+ * Fill in a read-only buffer of the last values or timestamps
+ * of the window, oldest first
+ *
+ * The buffer points into the ring of the window, which the window
+ * reference keeps allocated: its content is only the window of the
+ * current reading, the following readings shift it.
+ */
+static int windowBufferGet(WindowBufferObject* self, Py_buffer* view, int flags)
+{
+	WindowObject* window = self->window;
+	Py_ssize_t start = window->head + window->capacity - window->count;
+	void* buf = self->timestamps ?
+		    (void *)(window->timestamps + start) :
+		    (void *)(window->values + start);
+
+	self->shape = window->count;
+	if (PyBuffer_FillInfo(view, (PyObject *)self, buf,
+			      window->count * 8, 1, flags) < 0)
+	{
+		return -1;
+	}
+	view->itemsize = 8;
+	if (flags & PyBUF_FORMAT)
+	{
+		view->format = (char *)(self->timestamps ? "q" : "d");
+	}
+	if (flags & PyBUF_ND)
+	{
+		view->shape = &self->shape;
+	}
+	return 0;
+}
+
+static void windowBufferDealloc(WindowBufferObject* self)
+{
+	Py_DECREF(self->window);
+	PyObject_Del(self);
+}
+
+static PySequenceMethods windowSequence;
+
+static PyBufferProcs windowBuffer = {
+	(getbufferproc)windowBufferGet,
+	NULL
+};
+
+static PyGetSetDef windowGetSet[] = {
+	{ (char *)"values", (getter)windowGetValues, NULL,
+	  (char *)"Memoryview of the values, oldest first, valid for the current reading", NULL },
+	{ (char *)"timestamps", (getter)windowGetTimestamps, NULL,
+	  (char *)"Memoryview of the user timestamps in nanoseconds, valid for the current reading", NULL },
+	{ (char *)"capacity", (getter)windowGetCapacity, NULL,
+	  (char *)"The maximum number of values", NULL },
+	{ NULL, NULL, NULL, NULL, NULL }
+};
+
+/**
+ * Destructor: release the windows
+ */
+ReadingWindows::~ReadingWindows()
+{
+	PyGILState_STATE state = PyGILState_Ensure();
+	for (auto it = m_assets.begin(); it != m_assets.end(); ++it)
+	{
+		Py_CLEAR(it->second.m_dict);
+	}
+	Py_CLEAR(m_empty);
+	PyGILState_Release(state);
+}
+
+/**
+ * Exchange the windows with those of another instance
+ *
+ * @param other		The other windows
+ */
+void ReadingWindows::swap(ReadingWindows& other)
+{
+	m_specs.swap(other.m_specs);
+	m_assets.swap(other.m_assets);
+	std::swap(m_stringKeys, other.m_stringKeys);
+	std::swap(m_empty, other.m_empty);
+}
+
+/**
+ * Initialise the Python types of the windows, once.
+ *
+ * The Window type is added to the foglamp_reading module.
+ *
+ * @return	False if the types cannot be created
+ */
+bool ReadingWindows::initialise()
+{
+	if (WindowType.tp_flags & Py_TPFLAGS_READY)
+	{
+		return true;
+	}
+
+	windowSequence.sq_length = (lenfunc)windowLength;
+
+	WindowBufferType.tp_name = "foglamp_reading.WindowBuffer";
+	WindowBufferType.tp_doc = "The values or timestamps of a window";
+	WindowBufferType.tp_basicsize = sizeof(WindowBufferObject);
+	WindowBufferType.tp_flags = Py_TPFLAGS_DEFAULT;
+	WindowBufferType.tp_dealloc = (destructor)windowBufferDealloc;
+	WindowBufferType.tp_as_buffer = &windowBuffer;
+
+	WindowType.tp_name = "foglamp_reading.Window";
+	WindowType.tp_doc = "The last values of a datapoint";
+	WindowType.tp_basicsize = sizeof(WindowObject);
+	WindowType.tp_flags = Py_TPFLAGS_DEFAULT;
+	WindowType.tp_dealloc = (destructor)windowDealloc;
+	WindowType.tp_repr = (reprfunc)windowRepr;
+	WindowType.tp_as_sequence = &windowSequence;
+	WindowType.tp_getset = windowGetSet;
+
+	if (PyType_Ready(&WindowBufferType) < 0 || PyType_Ready(&WindowType) < 0)
+	{
+		return false;
+	}
+
+	PyObject* module = PyImport_AddModule("foglamp_reading");
+	Py_INCREF(&WindowType);
+	if (!module || PyModule_AddObject(module, "Window", (PyObject *)&WindowType) < 0)
+	{
+		PyErr_Clear();
+	}
+
+	return true;
+}
+
+/**
+ * Set the windows to keep, discarding the current ones
+ *
+ * @param config	The JSON configuration
+ * @param stringKeys	Datapoint names are str keys
+ * @return		False with the Python error set if the
+ *			configuration is not valid
+ */
+bool ReadingWindows::configure(const string& config, bool stringKeys)
+{
+	m_stringKeys = stringKeys;
+	m_specs.clear();
+	for (auto it = m_assets.begin(); it != m_assets.end(); ++it)
+	{
+		Py_CLEAR(it->second.m_dict);
+	}
+	m_assets.clear();
+
+	if (!m_empty && (m_empty = PyDict_New()) == NULL)
+	{
+		return false;
+	}
+
+	PyObject* windows;
+	bool valid = JsonConfig::parse(config, &PyDict_Type, windows);
+	PyObject *asset, *datapoints;
+	Py_ssize_t pos = 0;
+	while (valid && windows && PyDict_Next(windows, &pos, &asset, &datapoints))
+	{
+		const char* assetName = PyUnicode_AsUTF8(asset);
+		valid = assetName && PyDict_Check(datapoints);
+		if (!valid)
+		{
+			break;
+		}
+		WindowSpec& spec = m_specs[assetName];
+		PyObject *name, *size;
+		Py_ssize_t dpPos = 0;
+		while (valid && PyDict_Next(datapoints, &dpPos, &name, &size))
+		{
+			const char* dpName = PyUnicode_AsUTF8(name);
+			Py_ssize_t capacity = PyLong_Check(size) ? PyLong_AsSsize_t(size) : 0;
+			valid = dpName && capacity > 0;
+			if (valid)
+			{
+				spec.push_back(make_pair(string(dpName), capacity));
+			}
+		}
+	}
+	Py_XDECREF(windows);
+
+	if (!valid)
+	{
+		m_specs.clear();
+		return JsonConfig::invalid("Windows must be a JSON object of asset names "
+					   "to objects of datapoint names and window sizes");
+	}
+	return true;
+}
+
+/**
+ * Return the windows of an asset, created on first use
+ *
+ * @param asset		The asset name
+ * @return		The windows, NULL if the asset has none
+ */
+ReadingWindows::AssetWindows* ReadingWindows::getAssetWindows(const string& asset)
+{
+	auto found = m_assets.find(asset);
+	if (found != m_assets.end())
+	{
+		return found->second.m_dict ? &found->second : NULL;
+	}
+
+	AssetWindows& windows = m_assets[asset];
+	windows.m_dict = NULL;
+
+	auto spec = m_specs.find(asset);
+	if (spec == m_specs.end())
+	{
+		spec = m_specs.find("*");
+	}
+	if (spec == m_specs.end())
+	{
+		return NULL;
+	}
+
+	windows.m_dict = PyDict_New();
+	for (auto it = spec->second.begin(); windows.m_dict && it != spec->second.end(); ++it)
+	{
+		PyObject* key = PythonDatapoint::nameToKey(it->first, m_stringKeys);
+		PyObject* window = windowNew(it->second);
+		if (!key || !window || PyDict_SetItem(windows.m_dict, key, window) < 0)
+		{
+			Py_CLEAR(windows.m_dict);
+		}
+		else
+		{
+			windows.m_windows.push_back(make_pair(it->first, window));
+		}
+		Py_XDECREF(key);
+		Py_XDECREF(window);
+	}
+	if (!windows.m_dict)
+	{
+		windows.m_windows.clear();
+		PyErr_Clear();
+		return NULL;
+	}
+	return &windows;
+}
+
+/**
+ * Add the values of a reading to the windows of its asset
+ *
+ * Integer and float datapoints are added, with the user timestamp
+ * of the reading; other datapoints are ignored.
+ *
+ * @param reading	The reading
+ * @return		Borrowed reference to the dict of the windows
+ *			of the asset, empty if it has none
+ */
+PyObject* ReadingWindows::update(Reading* reading)
+{
+	AssetWindows* windows = getAssetWindows(reading->getAssetName());
+	if (!windows)
+	{
+		return m_empty;
+	}
+
+	struct timeval tv;
+	reading->getUserTimestamp(&tv);
+	long long timestamp = (long long)tv.tv_sec * 1000000000LL +
+			      (long long)tv.tv_usec * 1000LL;
+
+	for (auto it = windows->m_windows.begin(); it != windows->m_windows.end(); ++it)
+	{
+		Datapoint* dp = reading->getDatapoint(it->first);
+		double value;
+		if (dp && PythonDatapoint::toNumber(dp->getData(), value))
+		{
+			windowPush((WindowObject *)it->second, value, timestamp);
+		}
+	}
+	return windows->m_dict;
+}
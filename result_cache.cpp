@@ -0,0 +1,241 @@
+/*
+ * FogLAMP "Simple Python 3.x" filter cache of the code results.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <reading.h>
+#include "result_cache.h"
+
+using namespace std;
+
+/**
+ * Destructor: delete the values of the changes
+ */
+ResultCache::Result::~Result()
+{
+	for (auto it = m_changes.begin(); it != m_changes.end(); ++it)
+	{
+		delete it->m_value;
+	}
+}
+
+/**
+ * Destructor: delete the results
+ */
+ResultCache::~ResultCache()
+{
+	clear();
+}
+
+/**
+ * Forget the results
+ */
+void ResultCache::clear()
+{
+	for (auto it = m_entries.begin(); it != m_entries.end(); ++it)
+	{
+		delete it->second;
+	}
+	m_entries.clear();
+	m_index.clear();
+}
+
+/**
+ * Encode the value of a datapoint, NULL for none, so that the
+ * concatenation of encoded values can be split
+ *
+ * @param dp		The datapoint
+ * @param encoded	The string to append the encoded value to
+ * @return		False if the value is not an integer, a
+ *			float or a string
+ */
+bool ResultCache::encode(Datapoint* dp, string& encoded)
+{
+	if (!dp)
+	{
+		encoded += 'n';
+		return true;
+	}
+
+	DatapointValue& value = dp->getData();
+	switch (value.getType())
+	{
+	case DatapointValue::T_INTEGER:
+	{
+		long number = value.toInt();
+		encoded += 'i';
+		encoded.append((const char *)&number, sizeof(number));
+		return true;
+	}
+	case DatapointValue::T_FLOAT:
+	{
+		double number = value.toDouble();
+		encoded += 'f';
+		encoded.append((const char *)&number, sizeof(number));
+		return true;
+	}
+	case DatapointValue::T_STRING:
+	{
+		string text = value.toStringValue();
+		uint32_t length = text.length();
+		encoded += 's';
+		encoded.append((const char *)&length, sizeof(length));
+		encoded += text;
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+/**
+ * Build the key of a reading
+ *
+ * @param reading	The reading
+ * @param names		The names of the datapoints the code accesses
+ * @return		False if the reading cannot be memoized
+ */
+bool ResultCache::setKey(Reading* reading, const vector<string>& names)
+{
+	const string& asset = reading->getAssetName();
+	uint32_t length = asset.length();
+	m_key.assign((const char *)&length, sizeof(length));
+	m_key += asset;
+
+	m_inputs.resize(names.size());
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		m_inputs[i].clear();
+		if (!encode(reading->getDatapoint(names[i]), m_inputs[i]))
+		{
+			return false;
+		}
+		m_key += m_inputs[i];
+	}
+	return true;
+}
+
+/**
+ * Apply the result stored for the key of the reading, if any
+ *
+ * @param reading	The reading, whose key is set
+ * @param names		The names of the datapoints the code accesses
+ * @return		True if the result was found and applied
+ */
+bool ResultCache::apply(Reading* reading, const vector<string>& names)
+{
+	auto found = m_index.find(m_key);
+	if (found == m_index.end())
+	{
+		return false;
+	}
+
+	// Most recently used
+	m_entries.splice(m_entries.begin(), m_entries, found->second);
+	Result* result = found->second->second;
+
+	for (auto it = result->m_changes.begin(); it != result->m_changes.end(); ++it)
+	{
+		const string& name = names[it->m_index];
+		if (!it->m_value)
+		{
+			delete reading->removeDatapoint(name);
+			continue;
+		}
+		Datapoint* dp = reading->getDatapoint(name);
+		if (dp)
+		{
+			dp->getData() = *it->m_value;
+		}
+		else
+		{
+			reading->addDatapoint(new Datapoint(name, *it->m_value));
+		}
+	}
+	if (result->m_renamed)
+	{
+		reading->setAssetName(result->m_asset);
+	}
+	return true;
+}
+
+/**
+ * Store the changes the code has made to a reading, for its key
+ *
+ * @param reading	The reading, once changed by the code
+ * @param names		The names of the datapoints the code accesses
+ * @param inputAsset	The asset name before the code ran
+ */
+void ResultCache::store(Reading* reading,
+			const vector<string>& names,
+			const string& inputAsset)
+{
+	Result* result = new Result();
+
+	// Datapoints of the input reading the code has changed or removed
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		if (m_inputs[i] == "n")
+		{
+			continue;
+		}
+		Datapoint* dp = reading->getDatapoint(names[i]);
+		string output;
+		if (dp && encode(dp, output) && output == m_inputs[i])
+		{
+			continue;
+		}
+		Change change;
+		change.m_index = i;
+		change.m_value = dp ? new DatapointValue(dp->getData()) : NULL;
+		result->m_changes.push_back(change);
+	}
+
+	// Datapoints the code has added, in order
+	vector<Datapoint *>& datapoints = reading->getReadingData();
+	for (auto dp = datapoints.begin(); dp != datapoints.end(); ++dp)
+	{
+		for (size_t i = 0; i < names.size(); i++)
+		{
+			if (m_inputs[i] == "n" && names[i] == (*dp)->getName())
+			{
+				Change change;
+				change.m_index = i;
+				change.m_value = new DatapointValue((*dp)->getData());
+				result->m_changes.push_back(change);
+				break;
+			}
+		}
+	}
+
+	if (reading->getAssetName() != inputAsset)
+	{
+		result->m_renamed = true;
+		result->m_asset = reading->getAssetName();
+	}
+
+	auto found = m_index.find(m_key);
+	if (found != m_index.end())
+	{
+		delete found->second->second;
+		m_entries.erase(found->second);
+		m_index.erase(found);
+	}
+	else if (m_entries.size() >= m_capacity)
+	{
+		// Evict the least recently used result
+		delete m_entries.back().second;
+		m_index.erase(m_entries.back().first);
+		m_entries.pop_back();
+	}
+	m_entries.push_front(make_pair(m_key, result));
+	m_index[m_key] = m_entries.begin();
+}
@@ -0,0 +1,412 @@
+/*
+ * FogLAMP "Simple Python 3.x" filter shared memory store.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string>
+#include "shared_store.h"
+#include "fnv_hash.h"
+
+using namespace std;
+
+// Name of the shared memory segment
+#define STORE_NAME	"/foglamp-simple-python"
+// Marks a segment holding a store
+#define STORE_MAGIC	0x32765346504c4746ULL
+// Number of keys of the store
+#define STORE_SLOTS	4096
+// Maximum key length, with the terminating NUL
+#define KEY_SIZE	48
+
+// Hashes of keys are at least HASH_MIN, lower values of a slot
+// being written are the process id of its writer
+#define HASH_MIN	(1ULL << 32)
+// Milliseconds a slot being written is waited for
+#define BUSY_TIMEOUT	100
+
+/**
+ * The header of the segment
+ */
+typedef struct {
+	uint64_t	magic;
+	uint64_t	slots;
+	uint64_t	reserved[6];
+} StoreHeader;
+
+/**
+ * A key and its number, the bits of a double.
+ *
+ * A slot is free while its hash is 0. A process claims it by setting
+ * the hash to its process id, writes the key and the number, then sets
+ * the hash of the key: readers only compare the keys of slots whose
+ * hash matches the hash of their key. A slot claimed by a process that
+ * no longer exists is free again.
+ */
+typedef struct {
+	uint64_t	hash;
+	uint64_t	value;
+	char		key[KEY_SIZE];
+} StoreSlot;
+
+static StoreSlot* storeSlots = NULL;
+
+/**
+ * Map the shared memory segment, creating it if needed
+ *
+ * @return	False with the Python error set on failure
+ */
+static bool storeAttach()
+{
+	if (storeSlots)
+	{
+		return true;
+	}
+
+	size_t size = sizeof(StoreHeader) + STORE_SLOTS * sizeof(StoreSlot);
+	int fd = shm_open(STORE_NAME, O_RDWR | O_CREAT, 0660);
+	struct stat st;
+	if (fd < 0 ||
+	    fstat(fd, &st) < 0 ||
+	    ((size_t)st.st_size < size && ftruncate(fd, size) < 0))
+	{
+		int error = errno;
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		errno = error;
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, "/dev/shm" STORE_NAME);
+		return false;
+	}
+	void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		PyErr_SetFromErrnoWithFilename(PyExc_OSError, "/dev/shm" STORE_NAME);
+		return false;
+	}
+
+	// A new segment is filled with zeros: an empty store
+	StoreHeader* header = (StoreHeader *)map;
+	uint64_t slots = 0;
+	uint64_t magic = 0;
+	__atomic_compare_exchange_n(&header->slots, &slots, STORE_SLOTS,
+				    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	__atomic_compare_exchange_n(&header->magic, &magic, STORE_MAGIC,
+				    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	if ((slots && slots != STORE_SLOTS) || (magic && magic != STORE_MAGIC))
+	{
+		munmap(map, size);
+		PyErr_SetString(PyExc_OSError,
+				"/dev/shm" STORE_NAME " is not a compatible store");
+		return false;
+	}
+
+	storeSlots = (StoreSlot *)(header + 1);
+	return true;
+}
+
+/**
+ * Wait for a process to complete the writing of a slot
+ *
+ * The GIL is released while waiting. A slot whose writer has exited
+ * is set free.
+ *
+ * @param slot		The slot
+ * @param slotHash	The hash of the slot, the process id of its
+ *			writer, set to the new hash of the slot
+ * @return		False with the Python error set if the writer
+ *			does not complete the slot in time
+ */
+static bool storeWait(StoreSlot* slot, uint64_t& slotHash)
+{
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	bool timedOut = false;
+
+	Py_BEGIN_ALLOW_THREADS
+	while (slotHash && slotHash < HASH_MIN)
+	{
+		if (kill((pid_t)slotHash, 0) < 0 && errno == ESRCH)
+		{
+			// The writer has exited: free the slot
+			__atomic_compare_exchange_n(&slot->hash, &slotHash, 0,
+						    false, __ATOMIC_ACQ_REL,
+						    __ATOMIC_ACQUIRE);
+			slotHash = __atomic_load_n(&slot->hash, __ATOMIC_ACQUIRE);
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((now.tv_sec - start.tv_sec) * 1000 +
+		    (now.tv_nsec - start.tv_nsec) / 1000000 > BUSY_TIMEOUT)
+		{
+			timedOut = true;
+			break;
+		}
+		sched_yield();
+		slotHash = __atomic_load_n(&slot->hash, __ATOMIC_ACQUIRE);
+	}
+	Py_END_ALLOW_THREADS
+
+	if (timedOut)
+	{
+		PyErr_Format(PyExc_RuntimeError,
+			     "A slot of the shared store is being written by "
+			     "process %lu, try again", (unsigned long)slotHash);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Return the slot of a key
+ *
+ * @param key		The Python key, str or bytes
+ * @param create	Claim a free slot if the key is not found
+ * @return		The slot, NULL without error set if the key
+ *			is not found, or with the Python error set
+ */
+static StoreSlot* storeFind(PyObject* key, bool create)
+{
+	const char* name;
+	Py_ssize_t length;
+	if (PyBytes_Check(key))
+	{
+		name = PyBytes_AS_STRING(key);
+		length = PyBytes_GET_SIZE(key);
+	}
+	else if (PyUnicode_Check(key))
+	{
+		name = PyUnicode_AsUTF8AndSize(key, &length);
+		if (!name)
+		{
+			return NULL;
+		}
+	}
+	else
+	{
+		PyErr_SetString(PyExc_TypeError, "Keys must be str or bytes");
+		return NULL;
+	}
+	if (length >= KEY_SIZE || memchr(name, '\0', length))
+	{
+		PyErr_Format(PyExc_ValueError,
+			     "Keys must have less than %d bytes and no NUL",
+			     KEY_SIZE);
+		return NULL;
+	}
+	if (!storeAttach())
+	{
+		return NULL;
+	}
+
+	// Values below HASH_MIN are reserved
+	uint64_t hash = fnvHash(name, length);
+	if (hash < HASH_MIN)
+	{
+		hash += HASH_MIN;
+	}
+
+	for (size_t probe = 0; probe < STORE_SLOTS; probe++)
+	{
+		StoreSlot* slot = &storeSlots[(hash + probe) % STORE_SLOTS];
+		uint64_t slotHash = __atomic_load_n(&slot->hash, __ATOMIC_ACQUIRE);
+		while (true)
+		{
+			if (slotHash == 0)
+			{
+				if (!create)
+				{
+					return NULL;
+				}
+				if (__atomic_compare_exchange_n(&slot->hash, &slotHash,
+								(uint64_t)getpid(),
+								false, __ATOMIC_ACQ_REL,
+								__ATOMIC_ACQUIRE))
+				{
+					memcpy(slot->key, name, length);
+					slot->key[length] = '\0';
+					__atomic_store_n(&slot->value, 0, __ATOMIC_RELAXED);
+					__atomic_store_n(&slot->hash, hash, __ATOMIC_RELEASE);
+					return slot;
+				}
+			}
+			if (slotHash >= HASH_MIN)
+			{
+				break;
+			}
+			// Another process is writing the key of the slot
+			if (!storeWait(slot, slotHash))
+			{
+				return NULL;
+			}
+		}
+		if (slotHash == hash &&
+		    strncmp(slot->key, name, KEY_SIZE) == 0 &&
+		    slot->key[length] == '\0')
+		{
+			return slot;
+		}
+	}
+
+	if (create)
+	{
+		PyErr_SetString(PyExc_RuntimeError, "The shared store is full");
+	}
+	return NULL;
+}
+
+static double storeLoad(StoreSlot* slot)
+{
+	uint64_t bits = __atomic_load_n(&slot->value, __ATOMIC_ACQUIRE);
+	double value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+static PyObject* storeGet(PyObject* module, PyObject* args)
+{
+	PyObject* key;
+	PyObject* defaultValue = Py_None;
+	if (!PyArg_ParseTuple(args, "O|O:get", &key, &defaultValue))
+	{
+		return NULL;
+	}
+	StoreSlot* slot = storeFind(key, false);
+	if (!slot)
+	{
+		if (PyErr_Occurred())
+		{
+			return NULL;
+		}
+		Py_INCREF(defaultValue);
+		return defaultValue;
+	}
+	return PyFloat_FromDouble(storeLoad(slot));
+}
+
+static PyObject* storeSet(PyObject* module, PyObject* args)
+{
+	PyObject* key;
+	double value;
+	if (!PyArg_ParseTuple(args, "Od:set", &key, &value))
+	{
+		return NULL;
+	}
+	StoreSlot* slot = storeFind(key, true);
+	if (!slot)
+	{
+		return NULL;
+	}
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	__atomic_store_n(&slot->value, bits, __ATOMIC_RELEASE);
+	Py_RETURN_NONE;
+}
+
+static PyObject* storeAdd(PyObject* module, PyObject* args)
+{
+	PyObject* key;
+	double delta = 1.0;
+	if (!PyArg_ParseTuple(args, "O|d:add", &key, &delta))
+	{
+		return NULL;
+	}
+	StoreSlot* slot = storeFind(key, true);
+	if (!slot)
+	{
+		return NULL;
+	}
+	uint64_t bits = __atomic_load_n(&slot->value, __ATOMIC_ACQUIRE);
+	double sum;
+	uint64_t sumBits;
+	do
+	{
+		double value;
+		memcpy(&value, &bits, sizeof(value));
+		sum = value + delta;
+		memcpy(&sumBits, &sum, sizeof(sumBits));
+	} while (!__atomic_compare_exchange_n(&slot->value, &bits, sumBits,
+					      true, __ATOMIC_ACQ_REL,
+					      __ATOMIC_ACQUIRE));
+	return PyFloat_FromDouble(sum);
+}
+
+static PyObject* storeKeys(PyObject* module, PyObject* unused)
+{
+	if (!storeAttach())
+	{
+		return NULL;
+	}
+	PyObject* keys = PyList_New(0);
+	for (size_t i = 0; keys && i < STORE_SLOTS; i++)
+	{
+		uint64_t hash = __atomic_load_n(&storeSlots[i].hash, __ATOMIC_ACQUIRE);
+		if (hash < HASH_MIN)
+		{
+			continue;
+		}
+		PyObject* key = PyUnicode_DecodeUTF8(storeSlots[i].key,
+						     strnlen(storeSlots[i].key, KEY_SIZE),
+						     "surrogateescape");
+		if (!key || PyList_Append(keys, key) < 0)
+		{
+			Py_CLEAR(keys);
+		}
+		Py_XDECREF(key);
+	}
+	return keys;
+}
+
+static PyMethodDef storeMethods[] = {
+	{ "get", storeGet, METH_VARARGS, "get(key, default=None): return the number of a key" },
+	{ "set", storeSet, METH_VARARGS, "set(key, value): set the number of a key" },
+	{ "add", storeAdd, METH_VARARGS, "add(key, delta=1): add to the number of a key, return the sum" },
+	{ "keys", storeKeys, METH_NOARGS, "keys(): return the list of the keys" },
+	{ NULL, NULL, 0, NULL }
+};
+
+static struct PyModuleDef storeModule = {
+	PyModuleDef_HEAD_INIT,
+	"foglamp_shared",
+	"Numbers shared by the filters of the host",
+	-1,
+	storeMethods
+};
+
+/**
+ * Create the foglamp_shared module and add it to sys.modules, once
+ *
+ * @return	False if the module cannot be created
+ */
+bool SharedStore::initialise()
+{
+	PyObject* modules = PyImport_GetModuleDict();
+	if (PyDict_GetItemString(modules, "foglamp_shared"))
+	{
+		return true;
+	}
+	PyObject* module = PyModule_Create(&storeModule);
+	if (!module)
+	{
+		return false;
+	}
+	bool ret = PyDict_SetItemString(modules, "foglamp_shared", module) == 0;
+	Py_DECREF(module);
+	return ret;
+}
@@ -0,0 +1,1753 @@
+/*
+ * FogLAMP "simplepython" filter class.
+ *
+ * Copyright (c) 2019 Dianomic Systems
+ *
+ * Released under the Apache 2.0 Licence
+ *
+ * Author: Massimiliano Pinto
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <reading_set.h>
+#include <logger.h>
+#include <config_category.h>
+#include <reading.h>
+#include <pythonreading.h>
+#include "simple_python.h"
+#include "reading_view.h"
+#include "reading_context.h"
+#include "array_view.h"
+#include "python_stats.h"
+#include "fnv_hash.h"
+
+using namespace std;
+
+// Interval between checks of the readings held by the join and the
+// decimation
+#define RELEASE_INTERVAL	chrono::milliseconds(100)
+
+/**
+ * Destructor: remove Python objects
+ *
+ * The last reference may be released by any thread, the GIL
+ * is taken if not already held.
+ */
+CompiledCode::~CompiledCode()
+{
+	PyGILState_STATE state = PyGILState_Ensure();
+	m_code.reset();
+	m_timer.reset();
+	Py_CLEAR(m_globals);
+	PyGILState_Release(state);
+}
+
+/**
+ * Destructor: stop the threads of the filter
+ */
+SimplePythonFilter::~SimplePythonFilter()
+{
+	// The threads need the GIL: stop them before releasing Python objects.
+	// A pending compilation may start the timer, wait for it first.
+	waitCompilation();
+	stopTimer();
+	stopRelease();
+	stopCheckpoints();
+	m_compiled.reset();
+}
+
+/**
+ * Compile the setup, per-reading and timer Python code, create the
+ * filter global dictionary and run the setup code into it.
+ *
+ * The global dictionary holds the 'user_data' dict which is
+ * available to the per-reading code as a global variable. When
+ * checkpoints are enabled the first code configured gets the
+ * 'user_data' of the checkpoint taken with the same code, if any,
+ * before the setup code runs.
+ *
+ * The compiled code is built aside while the current one keeps
+ * serving readings, the configuration lock is only taken for the
+ * time needed to swap them.
+ *
+ * @return	True on success, false if the code cannot be compiled
+ *		or the setup code raises an error. On failure the
+ *		current code is left unchanged.
+ */
+bool SimplePythonFilter::configure()
+{
+	lock();
+	string code = m_code;
+	string setup = m_setup;
+	string timerCode = m_timerCode;
+	bool stringKeys = m_stringKeys;
+	bool arrayViews = m_arrayViews;
+	string windows = m_windows;
+	unsigned int memoize = m_memoize;
+	string lookups = m_lookups;
+	uint64_t hash = codeHash();
+	m_codeHash = hash;
+	bool restore = m_checkpointInterval && !m_compiled;
+	string checkpointPath = m_checkpointPath;
+	unlock();
+
+	PyGILState_STATE state = PyGILState_Ensure();
+
+	if (!ReadingView::initialise() ||
+	    !ArrayViews::initialise() ||
+	    !ReadingWindows::initialise() ||
+	    !PythonStats::initialise() ||
+	    !LookupTables::initialise() ||
+	    !SharedStore::initialise())
+	{
+		logErrorMessage("Python types");
+		PyGILState_Release(state);
+		return abandonCode(hash);
+	}
+
+	shared_ptr<CompiledCode> compiled(new CompiledCode());
+	compiled->m_hash = hash;
+	compiled->m_stringKeys = stringKeys;
+	compiled->m_arrayViews = arrayViews;
+	compiled->m_results.setCapacity(memoize);
+	if (!compiled->m_windows.configure(windows, stringKeys))
+	{
+		logErrorMessage("windows", windows);
+		compiled.reset();
+		PyGILState_Release(state);
+		return abandonCode(hash);
+	}
+	if (!compiled->m_lookups.configure(lookups))
+	{
+		logErrorMessage("lookups", lookups);
+		compiled.reset();
+		PyGILState_Release(state);
+		return abandonCode(hash);
+	}
+
+	if (code.length())
+	{
+		compiled->m_code = compileCode(code, "<code>");
+		if (!compiled->m_code)
+		{
+			compiled.reset();
+			PyGILState_Release(state);
+			return abandonCode(hash);
+		}
+	}
+
+	if (timerCode.length())
+	{
+		compiled->m_timer = compileCode(timerCode, "<timer>");
+		if (!compiled->m_timer)
+		{
+			compiled.reset();
+			PyGILState_Release(state);
+			return abandonCode(hash);
+		}
+	}
+
+	// New global dictionary, with an empty 'user_data' dict
+	compiled->m_globals = PyDict_New();
+	PyDict_SetItemString(compiled->m_globals, "__builtins__", PyEval_GetBuiltins());
+	PyObject* userData = PyDict_New();
+	PyDict_SetItemString(compiled->m_globals, "user_data", userData);
+	if (restore && Checkpoint::restore(checkpointPath, hash, userData))
+	{
+		Logger::getLogger()->info("Filter '%s': user_data restored from '%s'",
+					  getConfig().getName().c_str(),
+					  checkpointPath.c_str());
+	}
+	Py_CLEAR(userData);
+	if (compiled->m_lookups.isEnabled())
+	{
+		PyDict_SetItemString(compiled->m_globals, "lookups", compiled->m_lookups.getDict());
+	}
+
+	if (setup.length())
+	{
+		shared_ptr<CachedCode> compiledSetup = compileCode(setup, "<setup>");
+		PyObject* run = NULL;
+		if (compiledSetup)
+		{
+			// Run once: names defined by the setup code go into globals
+			run = PyEval_EvalCode(compiledSetup->getCode(),
+					      compiled->m_globals,
+					      compiled->m_globals);
+			if (!run)
+			{
+				logErrorMessage("setup code", setup);
+			}
+		}
+		compiledSetup.reset();
+
+		if (!run)
+		{
+			compiled.reset();
+			PyGILState_Release(state);
+			return abandonCode(hash);
+		}
+		Py_CLEAR(run);
+	}
+
+	bool hasTimer = (bool)compiled->m_timer;
+
+	// Swap in the new code, the old one is released when
+	// the last ingest using it completes
+	lock();
+	m_compiled.swap(compiled);
+	unlock();
+	compiled.reset();
+
+	PyGILState_Release(state);
+
+	if (hasTimer)
+	{
+		startTimer();
+	}
+	else
+	{
+		stopTimer();
+	}
+
+	return true;
+}
+
+/**
+ * Give up code that cannot be set up: the hash of the code being
+ * compiled is set back to that of the code in use, so that the code
+ * in use is not compiled again when the configuration reverts to it
+ *
+ * @param hash		The hash of the code given up
+ * @return		False
+ */
+bool SimplePythonFilter::abandonCode(uint64_t hash)
+{
+	lock();
+	// A later reconfiguration may be compiling other code already
+	if (m_codeHash == hash)
+	{
+		m_codeHash = m_compiled ? m_compiled->m_hash : 0;
+	}
+	unlock();
+	return false;
+}
+
+/**
+ * Return the hash of the Python code configuration items.
+ *
+ * The windows and the lookup tables are not part of it: they are
+ * replaced in the compiled code, which keeps its user_data.
+ *
+ * The caller must hold the configuration lock.
+ *
+ * @return	The hash of the code, setup code, timer code,
+ *		of the way datapoints are passed to the code and of
+ *		the memoization size
+ */
+uint64_t SimplePythonFilter::codeHash()
+{
+	string all = m_stringKeys ? "str" : "bytes";
+	all += m_arrayViews ? "views" : "lists";
+	all += to_string(m_memoize);
+	all += '\0';
+	all += m_code;
+	all += '\0';
+	all += m_setup;
+	all += '\0';
+	all += m_timerCode;
+	return fnvHash(all);
+}
+
+/**
+ * Replace the sliding windows of the code in use by new ones set up
+ * from the windows configuration item, the code and its user_data
+ * are kept
+ *
+ * @return	False if the configuration is not valid, the current
+ *		windows are then left unchanged
+ */
+bool SimplePythonFilter::configureWindows()
+{
+	lock();
+	string config = m_windows;
+	shared_ptr<CompiledCode> compiled = m_compiled;
+	unlock();
+	if (!compiled)
+	{
+		// The windows are set up with the code
+		return true;
+	}
+
+	PyGILState_STATE state = PyGILState_Ensure();
+	bool valid;
+	{
+		ReadingWindows windows;
+		valid = windows.configure(config, compiled->m_stringKeys);
+		if (valid)
+		{
+			// Between two executions of the code
+			lockExecution();
+			compiled->m_windows.swap(windows);
+			compiled->m_results.clear();
+			unlockExecution();
+		}
+		else
+		{
+			logErrorMessage("windows", config);
+		}
+	}
+	compiled.reset();
+	PyGILState_Release(state);
+	return valid;
+}
+
+/**
+ * Replace the lookup tables of the code in use by new ones set up
+ * from the lookups configuration item, the code and its user_data
+ * are kept
+ *
+ * @return	False if the configuration is not valid or a file
+ *		cannot be read, the current tables are then left
+ *		unchanged
+ */
+bool SimplePythonFilter::configureLookups()
+{
+	lock();
+	string config = m_lookups;
+	shared_ptr<CompiledCode> compiled = m_compiled;
+	unlock();
+	if (!compiled)
+	{
+		// The lookup tables are set up with the code
+		return true;
+	}
+
+	PyGILState_STATE state = PyGILState_Ensure();
+	bool valid;
+	{
+		LookupTables lookups;
+		valid = lookups.configure(config);
+		if (valid)
+		{
+			// Between two executions of the code
+			lockExecution();
+			compiled->m_lookups.swap(lookups);
+			compiled->m_results.clear();
+			if (compiled->m_lookups.isEnabled())
+			{
+				PyDict_SetItemString(compiled->m_globals, "lookups",
+						     compiled->m_lookups.getDict());
+			}
+			else if (PyDict_DelItemString(compiled->m_globals, "lookups") < 0)
+			{
+				PyErr_Clear();
+			}
+			unlockExecution();
+		}
+		else
+		{
+			logErrorMessage("lookups", config);
+		}
+	}
+	compiled.reset();
+	PyGILState_Release(state);
+	return valid;
+}
+
+/**
+ * Return the compiled code currently in use
+ *
+ * @return	The compiled code, empty if none
+ */
+shared_ptr<CompiledCode> SimplePythonFilter::getCompiled()
+{
+	lock_guard<mutex> guard(m_configMutex);
+	return m_compiled;
+}
+
+/**
+ * Set up a new deadband from the deadband configuration items,
+ * forgetting the last values of the current one
+ *
+ * @return	False if the configuration is not valid, the current
+ *		deadband is then left unchanged
+ */
+bool SimplePythonFilter::configureDeadband()
+{
+	lock();
+	string config = m_deadband;
+	bool drop = m_deadbandDrop;
+	unlock();
+
+	PyGILState_STATE state = PyGILState_Ensure();
+	shared_ptr<Deadband> deadband(new Deadband());
+	if (!deadband->configure(config, drop))
+	{
+		logErrorMessage("deadband", config);
+		deadband.reset();
+	}
+	PyGILState_Release(state);
+
+	if (!deadband)
+	{
+		return false;
+	}
+
+	lock();
+	m_activeDeadband.swap(deadband);
+	unlock();
+	return true;
+}
+
+/**
+ * Return the deadband currently in use
+ *
+ * @return	The deadband, empty if none
+ */
+shared_ptr<Deadband> SimplePythonFilter::getDeadband()
+{
+	lock_guard<mutex> guard(m_configMutex);
+	return m_activeDeadband;
+}
+
+/**
+ * Set up a new decimation from the decimation configuration item,
+ * the means of the current intervals are passed on
+ *
+ * @return	False if the configuration is not valid, the current
+ *		decimation is then left unchanged
+ */
+bool SimplePythonFilter::configureDecimation()
+{
+	lock();
+	string config = m_decimation;
+	unlock();
+
+	PyGILState_STATE state = PyGILState_Ensure();
+	shared_ptr<Decimation> decimation(new Decimation());
+	if (!decimation->configure(config))
+	{
+		logErrorMessage("decimation", config);
+		decimation.reset();
+	}
+	PyGILState_Release(state);
+
+	if (!decimation)
+	{
+		return false;
+	}
+
+	bool enabled = decimation->isEnabled();
+	lock();
+	m_activeDecimation.swap(decimation);
+	unlock();
+
+	if (decimation)
+	{
+		flushDecimation(decimation);
+	}
+	if (enabled)
+	{
+		startRelease();
+	}
+	return true;
+}
+
+/**
+ * Return the decimation currently in use
+ *
+ * @return	The decimation, empty if none
+ */
+shared_ptr<Decimation> SimplePythonFilter::getDecimation()
+{
+	lock_guard<mutex> guard(m_configMutex);
+	return m_activeDecimation;
+}
+
+/**
+ * Set up a new join from the join configuration item, the primary
+ * readings held by the current one are passed on
+ *
+ * @return	False if the configuration is not valid, the current
+ *		join is then left unchanged
+ */
+bool SimplePythonFilter::configureJoin()
+{
+	lock();
+	string config = m_join;
+	unlock();
+
+	PyGILState_STATE state = PyGILState_Ensure();
+	shared_ptr<Join> join(new Join());
+	if (!join->configure(config))
+	{
+		logErrorMessage("join", config);
+		join.reset();
+	}
+	PyGILState_Release(state);
+
+	if (!join)
+	{
+		return false;
+	}
+
+	bool enabled = join->isEnabled();
+	lock();
+	m_activeJoin.swap(join);
+	unlock();
+
+	if (join)
+	{
+		flushJoin(join);
+	}
+	if (enabled)
+	{
+		startRelease();
+	}
+	return true;
+}
+
+/**
+ * Pass on the readings held by a join no longer in use
+ *
+ * @param join		The join
+ */
+void SimplePythonFilter::flushJoin(const shared_ptr<Join>& join)
+{
+	vector<Reading *> held;
+	join->flush(held);
+	if (!held.empty())
+	{
+		ingest(new ReadingSet(&held), DECIMATION);
+	}
+}
+
+/**
+ * Pass on the mean readings of a decimation no longer in use
+ *
+ * @param decimation	The decimation
+ */
+void SimplePythonFilter::flushDecimation(const shared_ptr<Decimation>& decimation)
+{
+	vector<Reading *> held;
+	decimation->flush(held);
+	if (!held.empty())
+	{
+		ingest(new ReadingSet(&held), CODE);
+	}
+}
+
+/**
+ * Pass on the readings held by the join and the decimation, on
+ * shutdown
+ *
+ * Must be called once the ingest has stopped and without the GIL
+ * held.
+ */
+void SimplePythonFilter::flushStages()
+{
+	stopRelease();
+
+	shared_ptr<Join> join = getJoin();
+	if (join)
+	{
+		flushJoin(join);
+	}
+	shared_ptr<Decimation> decimation = getDecimation();
+	if (decimation)
+	{
+		flushDecimation(decimation);
+	}
+}
+
+/**
+ * Start the thread that releases the readings held for too long by
+ * the join and the decimation, if not running
+ */
+void SimplePythonFilter::startRelease()
+{
+	lock_guard<mutex> guard(m_releaseMutex);
+	if (m_releaseRunning)
+	{
+		return;
+	}
+	m_releaseRunning = true;
+	m_releaseThread = thread(&SimplePythonFilter::releaseLoop, this);
+}
+
+/**
+ * Stop the release thread and wait for it to finish.
+ *
+ * Must not be called with the GIL held.
+ */
+void SimplePythonFilter::stopRelease()
+{
+	{
+		lock_guard<mutex> guard(m_releaseMutex);
+		if (!m_releaseRunning)
+		{
+			return;
+		}
+		m_releaseRunning = false;
+	}
+	m_releaseCV.notify_all();
+	m_releaseThread.join();
+}
+
+/**
+ * Release thread: pass on the readings the join and the decimation
+ * have held for longer than their tolerance or interval on the wall
+ * clock, even if no more readings arrive
+ */
+void SimplePythonFilter::releaseLoop()
+{
+	unique_lock<mutex> guard(m_releaseMutex);
+	while (m_releaseRunning)
+	{
+		chrono::steady_clock::time_point deadline = chrono::steady_clock::now() +
+							    RELEASE_INTERVAL;
+		if (m_releaseCV.wait_until(guard, deadline, [this]() { return !m_releaseRunning; }))
+		{
+			break;
+		}
+		guard.unlock();
+
+		lock();
+		bool enabled = isEnabled();
+		unlock();
+		shared_ptr<Join> join = getJoin();
+		shared_ptr<Decimation> decimation = getDecimation();
+		if ((join && join->hasExpired()) ||
+		    (decimation && decimation->hasExpired()))
+		{
+			if (enabled)
+			{
+				// The stages pass on the expired readings
+				vector<Reading *> none;
+				ingest(new ReadingSet(&none));
+			}
+			else
+			{
+				// The stages are bypassed while the filter is
+				// disabled: pass on the expired readings they
+				// still hold as they are
+				vector<Reading *> joined;
+				vector<Reading *> decimated;
+				if (join)
+				{
+					join->apply(joined);
+				}
+				if (decimation)
+				{
+					decimation->apply(decimated);
+				}
+				joined.insert(joined.end(), decimated.begin(), decimated.end());
+				sendReadings(new ReadingSet(&joined));
+			}
+		}
+
+		guard.lock();
+	}
+}
+
+/**
+ * Return the join currently in use
+ *
+ * @return	The join, empty if none
+ */
+shared_ptr<Join> SimplePythonFilter::getJoin()
+{
+	lock_guard<mutex> guard(m_configMutex);
+	return m_activeJoin;
+}
+
+/**
+ * Apply a new configuration to the filter
+ *
+ * The code is compiled by a background thread, the current code
+ * keeps processing readings until the new one is ready.
+ * If the new code fails to compile the current code stays active.
+ *
+ * Code that has not changed is not compiled again, so the global
+ * names and the 'user_data' of the current code are kept.
+ *
+ * @param newConfig	The new configuration category JSON
+ */
+void SimplePythonFilter::reconfigure(const string& newConfig)
+{
+	ConfigCategory category("new", newConfig);
+
+	// Lock configuration items
+	lock();
+
+	// Update Python code to execute
+	if (category.itemExists("code"))
+	{
+		m_code = category.getValue("code");
+	}
+
+	// Update Python setup code
+	if (category.itemExists("setup"))
+	{
+		m_setup = category.getValue("setup");
+	}
+
+	// Update Python timer code and its interval
+	if (category.itemExists("timerCode"))
+	{
+		m_timerCode = category.getValue("timerCode");
+	}
+	if (category.itemExists("timerInterval"))
+	{
+		m_timerInterval = atoi(category.getValue("timerInterval").c_str());
+	}
+
+	// Update the type of the datapoint name keys
+	if (category.itemExists("keyType"))
+	{
+		m_stringKeys = category.getValue("keyType").compare("str") == 0;
+	}
+
+	// Update the type of the array datapoints
+	if (category.itemExists("arrayViews"))
+	{
+		m_arrayViews = category.getValue("arrayViews").compare("true") == 0 ||
+			       category.getValue("arrayViews").compare("True") == 0;
+	}
+
+	// Update the checkpoint interval
+	if (category.itemExists("checkpointInterval"))
+	{
+		m_checkpointInterval = atoi(category.getValue("checkpointInterval").c_str());
+	}
+
+	// Update the lookup tables
+	bool lookupsChanged = false;
+	if (category.itemExists("lookups") &&
+	    category.getValue("lookups").compare(m_lookups) != 0)
+	{
+		m_lookups = category.getValue("lookups");
+		lookupsChanged = true;
+	}
+
+	// Update the number of memoized results
+	if (category.itemExists("memoize"))
+	{
+		m_memoize = atoi(category.getValue("memoize").c_str());
+	}
+
+	// Update the sliding windows
+	bool windowsChanged = false;
+	if (category.itemExists("windows") &&
+	    category.getValue("windows").compare(m_windows) != 0)
+	{
+		m_windows = category.getValue("windows");
+		windowsChanged = true;
+	}
+
+	// Update the deadband
+	bool deadbandChanged = false;
+	if (category.itemExists("deadband") &&
+	    category.getValue("deadband").compare(m_deadband) != 0)
+	{
+		m_deadband = category.getValue("deadband");
+		deadbandChanged = true;
+	}
+	if (category.itemExists("deadbandAction") &&
+	    (category.getValue("deadbandAction").compare("drop") == 0) != m_deadbandDrop)
+	{
+		m_deadbandDrop = !m_deadbandDrop;
+		deadbandChanged = true;
+	}
+
+	// Update the decimation
+	bool decimationChanged = false;
+	if (category.itemExists("decimation") &&
+	    category.getValue("decimation").compare(m_decimation) != 0)
+	{
+		m_decimation = category.getValue("decimation");
+		decimationChanged = true;
+	}
+
+	// Update the joins
+	bool joinChanged = false;
+	if (category.itemExists("join") &&
+	    category.getValue("join").compare(m_join) != 0)
+	{
+		m_join = category.getValue("join");
+		joinChanged = true;
+	}
+
+	// Update the sort of the readings
+	if (category.itemExists("sortReadings"))
+	{
+		m_sortReadings = category.getValue("sortReadings").compare("true") == 0 ||
+				 category.getValue("sortReadings").compare("True") == 0;
+	}
+
+	// Update the enable flag
+	if (category.itemExists("enable"))
+	{
+		bool enabled = category.getValue("enable").compare("true") == 0 ||
+				category.getValue("enable").compare("True") == 0;
+
+		// The stages are bypassed while the filter is disabled:
+		// replace them, so that the readings they hold are passed on
+		if (isEnabled() && !enabled)
+		{
+			decimationChanged = true;
+			joinChanged = true;
+		}
+		setEnableFilter(enabled);
+	}
+
+	// Only compile code that has changed
+	uint64_t newHash = codeHash();
+	bool changed = newHash != m_codeHash;
+	m_codeHash = newHash;
+
+	// Unlock configuration items
+	unlock();
+
+	if (deadbandChanged && !configureDeadband())
+	{
+		Logger::getLogger()->error("Filter '%s': the new deadband is not "
+					   "valid, the current deadband remains active",
+					   getConfig().getName().c_str());
+	}
+
+	if (decimationChanged && !configureDecimation())
+	{
+		Logger::getLogger()->error("Filter '%s': the new decimation is not "
+					   "valid, the current decimation remains active",
+					   getConfig().getName().c_str());
+	}
+
+	if (joinChanged && !configureJoin())
+	{
+		Logger::getLogger()->error("Filter '%s': the new join is not "
+					   "valid, the current join remains active",
+					   getConfig().getName().c_str());
+	}
+
+	if (!changed && !windowsChanged && !lookupsChanged)
+	{
+		return;
+	}
+
+	// Wait for a previous compilation, then compile in background,
+	// or only replace the windows and the lookup tables of the code
+	waitCompilation();
+	m_compileThread = thread([this, changed, windowsChanged, lookupsChanged]() {
+		if (changed && !this->configure())
+		{
+			Logger::getLogger()->error("Filter '%s': the new Python code "
+						   "is not valid, the current code "
+						   "remains active",
+						   this->getConfig().getName().c_str());
+		}
+		if (!changed && windowsChanged && !this->configureWindows())
+		{
+			Logger::getLogger()->error("Filter '%s': the new windows are "
+						   "not valid, the current windows "
+						   "remain active",
+						   this->getConfig().getName().c_str());
+		}
+		if (!changed && lookupsChanged && !this->configureLookups())
+		{
+			Logger::getLogger()->error("Filter '%s': the new lookup tables "
+						   "are not valid, the current tables "
+						   "remain active",
+						   this->getConfig().getName().c_str());
+		}
+	});
+}
+
+/**
+ * Wait for the background compilation started by the last
+ * reconfiguration, if any, to complete
+ *
+ * The caller must not hold the GIL.
+ */
+void SimplePythonFilter::waitCompilation()
+{
+	if (m_compileThread.joinable())
+	{
+		m_compileThread.join();
+	}
+}
+
+/**
+ * Compile Python code, sharing the compiled code with the
+ * filters that have the same code.
+ *
+ * The caller must hold the GIL.
+ *
+ * @param code		The Python code
+ * @param name		The name reported in Python tracebacks
+ * @return		The compiled code, empty on error
+ */
+shared_ptr<CachedCode> SimplePythonFilter::compileCode(const string& code,
+							const char* name)
+{
+	shared_ptr<CachedCode> compiled = CodeCache::getInstance()->compile(code, name);
+	if (!compiled)
+	{
+		logErrorMessage(strcmp(name, "<setup>") == 0 ? "setup code" :
+				strcmp(name, "<timer>") == 0 ? "timer code" :
+				"Python code",
+				code);
+	}
+
+	return compiled;
+}
+
+/**
+ * Take the execution lock of the Python code of the filter
+ *
+ * The caller holds the GIL, which is released while waiting: the
+ * holder of the lock may need it to complete.
+ */
+void SimplePythonFilter::lockExecution()
+{
+	if (!m_execMutex.try_lock())
+	{
+		PyThreadState* thread = PyEval_SaveThread();
+		m_execMutex.lock();
+		PyEval_RestoreThread(thread);
+	}
+}
+
+/**
+ * Log current Python 3.x error message
+ *
+ * The caller must hold the GIL.
+ *
+ * @param item		The name of the configuration item that failed
+ * @param text		The code or configuration of the item, if any
+ */
+void SimplePythonFilter::logErrorMessage(const char* item, const string& text)
+{
+#ifdef PYTHON_CONSOLE_DEBUG
+	// Print full Python stacktrace 
+	PyErr_Print();
+#endif
+	//Get error message
+	PyObject *pType, *pValue, *pTraceback;
+	PyErr_Fetch(&pType, &pValue, &pTraceback);
+	PyErr_NormalizeException(&pType, &pValue, &pTraceback);
+
+	PyObject* str_exc_value = PyObject_Repr(pValue);
+	PyObject* pyExcValueStr = PyUnicode_AsEncodedString(str_exc_value,
+							    "utf-8",
+							    "Error ~");
+
+	// NOTE from :
+	// https://docs.python.org/3.5/c-api/exceptions.html
+	//
+	// The value and traceback object may be NULL
+	// even when the type object is not.	
+	const char* pErrorMessage = pValue ?
+				    PyBytes_AsString(pyExcValueStr) :
+				    "no error description.";
+
+	if (text.empty())
+	{
+		Logger::getLogger()->fatal("Filter '%s', %s: Error '%s'",
+					   this->getConfig().getName().c_str(),
+					   item,
+					   pErrorMessage);
+	}
+	else
+	{
+		Logger::getLogger()->fatal("Filter '%s', %s "
+					   "'%s': Error '%s'",
+					   this->getConfig().getName().c_str(),
+					   item,
+					   text.c_str(),
+					   pErrorMessage);
+	}
+
+	// Reset error
+	PyErr_Clear();
+
+	// Remove references
+	Py_CLEAR(pType);
+	Py_CLEAR(pValue);
+	Py_CLEAR(pTraceback);
+	Py_CLEAR(str_exc_value);
+	Py_CLEAR(pyExcValueStr);
+}
+
+/**
+ * Process a set of readings and pass the output readings onwards
+ *
+ * The readings go through the stages in order: sorting, join,
+ * decimation, then deadband and per-reading code. Readings released
+ * by a stage outside of the ingest, such as the held readings of a
+ * join being replaced, enter the pipeline at the next stage.
+ *
+ * Must be called without the GIL held.
+ *
+ * @param readingSet	The readings to process
+ * @param first		The first stage the readings go through
+ */
+void SimplePythonFilter::ingest(READINGSET* readingSet, Stage first)
+{
+	bool enabled = false;
+	bool sortReadings = false;
+
+	// Lock configuration items
+	lock();
+	enabled = isEnabled();
+	sortReadings = m_sortReadings && first == SORT;
+	// Unlock configuration items
+	unlock();
+
+	// Hold the compiled code and the native stages in use:
+	// a reconfiguration may replace them
+	shared_ptr<CompiledCode> compiled = getCompiled();
+	shared_ptr<Join> join = getJoin();
+	shared_ptr<Decimation> decimation = getDecimation();
+	shared_ptr<Deadband> deadband = getDeadband();
+	bool runCode = compiled && compiled->m_code;
+	if (join && (!join->isEnabled() || first > JOIN))
+	{
+		join.reset();
+	}
+	if (decimation && (!decimation->isEnabled() || first > DECIMATION))
+	{
+		decimation.reset();
+	}
+	if (deadband && !deadband->isEnabled())
+	{
+		deadband.reset();
+	}
+
+	if (!enabled || (!runCode && !deadband && !decimation && !join && !sortReadings))
+	{
+		// Current filter is not active: just pass the readings set
+		sendReadings(readingSet);
+		return;
+	}
+
+	// Just get all the readings in the readingset
+	vector<Reading *>* readings = ((ReadingSet *)readingSet)->getAllReadingsPtr();
+
+	// Put the readings of each asset in order for the stateful stages
+	if (sortReadings)
+	{
+		ReadingOrder::sort(*readings);
+	}
+
+	// Merge the readings of joined assets
+	if (join)
+	{
+		join->apply(*readings);
+	}
+
+	// Reduce high rate assets before any conversion to Python
+	if (decimation)
+	{
+		decimation->apply(*readings);
+	}
+
+	if (!runCode && !deadband)
+	{
+		sendReadings(readingSet);
+		return;
+	}
+
+	PyGILState_STATE state = PyGILState_Ensure(); // acquire GIL
+
+	if (runCode)
+	{
+		// Use the new versions of the lookup table files: results
+		// memoized with the previous versions no longer apply
+		if (compiled->m_lookups.refresh())
+		{
+			compiled->m_results.clear();
+		}
+	}
+
+	// Output readings: one input reading may produce zero or more
+	vector<Reading *> out;
+	out.reserve(readings->size());
+
+	{
+		// Python objects reused from one reading to the next
+		ReadingContext context;
+
+		// Iterate the input readings
+		for (vector<Reading *>::iterator elem = readings->begin();
+						 elem != readings->end();
+						 ++elem)
+		{
+			// The GIL serialises the deadband of the threads
+			if (deadband && !deadband->hasChanged(*elem))
+			{
+				// No significant change: do not run the code, but
+				// keep the windows of the code complete
+				if (runCode && compiled->m_windows.isEnabled())
+				{
+					compiled->m_windows.update(*elem);
+				}
+				if (deadband->dropsReadings())
+				{
+					delete *elem;
+				}
+				else
+				{
+					out.push_back(*elem);
+				}
+			}
+			else if (runCode)
+			{
+				processReading(*elem, compiled.get(), context, out);
+			}
+			else
+			{
+				out.push_back(*elem);
+			}
+		}
+	}
+
+	// Replace the readings in the reading set with the output ones
+	readings->swap(out);
+
+	if (runCode)
+	{
+		// Checkpoint user_data between sets of readings
+		checkpoint(compiled.get());
+	}
+
+	compiled.reset();
+
+	PyGILState_Release(state);
+
+	// Pass readingSet to the next filter
+	sendReadings(readingSet);
+}
+
+/**
+ * Run the per-reading Python code for one reading
+ *
+ * The reading is passed to the code either as a dict of the
+ * datapoints the code accesses, when these are known, or as a view
+ * which converts datapoints when they are accessed. Only a reading
+ * the code has modified is changed, in place. Readings with datapoint
+ * types the view does not support are converted by PythonReading.
+ * The sliding windows of the asset, if any, are updated first.
+ *
+ * The caller must hold the GIL.
+ *
+ * @param reading	The input reading
+ * @param compiled	The compiled code to run
+ * @param context	The Python objects reused between readings
+ * @param out		The vector of output readings, the input
+ *			reading or the readings replacing it are
+ *			appended to it
+ */
+void SimplePythonFilter::processReading(Reading* reading,
+					CompiledCode* compiled,
+					ReadingContext& context,
+					vector<Reading *>& out)
+{
+	bool useView = ReadingView::isSupported(reading);
+	PyObject* locals;
+
+	// Code depending only on the values of the datapoints it uses
+	// has the same result for the same values
+	CachedCode* code = compiled->m_code.get();
+	ResultCache& results = compiled->m_results;
+	bool memoized = useView &&
+			results.isEnabled() &&
+			!compiled->m_windows.isEnabled() &&
+			!code->isDynamic(compiled->m_stringKeys) &&
+			results.setKey(reading, code->getDatapoints());
+	if (memoized && results.apply(reading, code->getDatapoints()))
+	{
+		if (reading->getAssetName() != context.m_trackedAsset)
+		{
+			trackAsset(reading->getAssetName());
+			context.m_trackedAsset = reading->getAssetName();
+		}
+		out.push_back(reading);
+		return;
+	}
+	string inputAsset = memoized ? reading->getAssetName() : string();
+
+	if (useView)
+	{
+		// Borrowed reference: do not remove object
+		locals = context.prepare(reading,
+					 code,
+					 compiled->m_stringKeys,
+					 compiled->m_arrayViews);
+	}
+	else
+	{
+		locals = ((PythonReading *)reading)->toPython(true);
+	}
+
+	if (compiled->m_windows.isEnabled())
+	{
+		// Add the reading to the windows of its asset
+		PyDict_SetItemString(locals, "windows", compiled->m_windows.update(reading));
+	}
+
+	// Run the compiled Python code, the timer code runs between readings
+	lockExecution();
+	PyObject* run = PyEval_EvalCode(code->getCode(),
+					compiled->m_globals,
+					locals);
+	unlockExecution();
+
+	bool deleted = false;
+	if (!run)
+	{
+		logErrorMessage("Python code", code->getSource());
+		// Pass the input reading unchanged
+		out.push_back(reading);
+	}
+	else
+	{
+		// Returns borrowed reference: do not remove object
+		PyObject* fanOutReadings = PyDict_GetItemString(locals, "output_readings");
+		if (fanOutReadings && fanOutReadings != Py_None)
+		{
+			// The code has set 'output_readings', a name unlikely to
+			// be used otherwise: replace the input reading
+			if (fanOut(locals, fanOutReadings, out,
+				   "Python code", "output_readings", code->getSource()))
+			{
+				deleted = true;
+			}
+			else
+			{
+				out.push_back(reading);
+			}
+		}
+		else if (useView && context.isCurrent())
+		{
+			// Apply the changes, if any, to the input reading
+			if (!context.writeBack())
+			{
+				logErrorMessage("Python code", code->getSource());
+			}
+			else
+			{
+				PyObject* newAssetCode = PyDict_GetItemString(locals, "asset_code");
+				if (newAssetCode != context.m_assetCode &&
+				    newAssetCode &&
+				    PyUnicode_Check(newAssetCode))
+				{
+					reading->setAssetName(PyUnicode_AsUTF8(newAssetCode));
+				}
+				if (memoized)
+				{
+					results.store(reading, code->getDatapoints(), inputAsset);
+				}
+			}
+			if (reading->getAssetName() != context.m_trackedAsset)
+			{
+				trackAsset(reading->getAssetName());
+				context.m_trackedAsset = reading->getAssetName();
+			}
+			out.push_back(reading);
+		}
+		else
+		{
+			// Set new Reading object with data returned by the Python code
+			PyObject* newDatapoints = PyDict_GetItemString(locals, "reading");
+			if (newDatapoints && PyDict_Check(newDatapoints))
+			{
+				PyObject* lists = ArrayViews::toLists(newDatapoints);
+				if (lists)
+				{
+					PyDict_SetItemString(locals, "reading", lists);
+					Py_DECREF(lists);
+				}
+				PyErr_Clear();
+			}
+			Reading* newReading = new PythonReading(locals);
+			trackAsset(newReading->getAssetName());
+			out.push_back(newReading);
+			deleted = true;
+		}
+	}
+
+	Py_CLEAR(run);
+	if (useView)
+	{
+		context.done(deleted);
+	}
+	else
+	{
+		Py_CLEAR(locals);
+	}
+
+	if (deleted)
+	{
+		// Delete reading data along with datapoints
+		delete reading;
+	}
+}
+
+/**
+ * Build the output readings from the iterable of dicts set by the
+ * Python code in a variable: 'output_readings' for the per-reading
+ * code, 'readings' for the timer code.
+ *
+ * Each item can be a dict of datapoints, which gets the asset name of
+ * the input reading, or a dict with 'asset_code' and 'reading' keys
+ * which allows setting a different asset name.
+ *
+ * @param inputDict	The Python dict of the input reading, NULL
+ *			when called for the timer code
+ * @param fanOut	The object the code has set in the variable
+ * @param out		The vector to append new readings to
+ * @param codeName	The name of the code, for errors
+ * @param variable	The name of the variable, for errors
+ * @param source	The source of the code, for errors
+ * @return		True on success, false if no reading was
+ *			added because of an error
+ */
+bool SimplePythonFilter::fanOut(PyObject* inputDict,
+				PyObject* fanOut,
+				vector<Reading *>& out,
+				const char* codeName,
+				const char* variable,
+				const string& source)
+{
+	// New reference, to remove
+	PyObject* iter = PyObject_GetIter(fanOut);
+	if (!iter)
+	{
+		logErrorMessage(codeName, source);
+		return false;
+	}
+
+	// Borrowed reference: do not remove object
+	PyObject* assetCode = inputDict ?
+			      PyDict_GetItemString(inputDict, "asset_code") :
+			      NULL;
+
+	size_t added = 0;
+	PyObject* item;
+	while ((item = PyIter_Next(iter)) != NULL)
+	{
+		// A dict of datapoints gets the input reading asset name
+		PyObject* itemAssetCode = assetCode;
+		PyObject* datapoints = item;
+		PyObject* readingDict = NULL;
+
+		if (PyDict_Check(item) && PyDict_GetItemString(item, "asset_code"))
+		{
+			// Full reading dict
+			itemAssetCode = PyDict_GetItemString(item, "asset_code");
+			datapoints = PyDict_GetItemString(item, "reading");
+			readingDict = PyDict_Copy(item);
+		}
+		else if (assetCode)
+		{
+			readingDict = PyDict_New();
+			PyDict_SetItemString(readingDict, "asset_code", itemAssetCode);
+		}
+
+		if (!readingDict ||
+		    !datapoints ||
+		    (!PyDict_Check(datapoints) && !ReadingView::check(datapoints)))
+		{
+			Logger::getLogger()->error("Filter '%s': items in '%s' "
+						   "must be dicts of datapoints or dicts "
+						   "with 'asset_code' and 'reading' keys, "
+						   "item ignored",
+						   this->getConfig().getName().c_str(),
+						   variable);
+			Py_CLEAR(readingDict);
+			Py_CLEAR(item);
+			continue;
+		}
+
+		// A reading view is copied into a dict, with its asset name if set;
+		// memoryviews of array datapoints are converted into lists
+		PyObject* dict;
+		if (ReadingView::check(datapoints))
+		{
+			PyObject* viewDict = ReadingView::toDict(datapoints);
+			dict = viewDict ? ArrayViews::toLists(viewDict) : NULL;
+			Py_XDECREF(viewDict);
+			PyObject* viewAsset = ReadingView::getAssetWritten(datapoints);
+			if (viewAsset && datapoints == item)
+			{
+				PyDict_SetItemString(readingDict, "asset_code", viewAsset);
+			}
+		}
+		else
+		{
+			dict = ArrayViews::toLists(datapoints);
+		}
+		if (!dict)
+		{
+			logErrorMessage(codeName, source);
+			Py_CLEAR(readingDict);
+			Py_CLEAR(item);
+			continue;
+		}
+		PyDict_SetItemString(readingDict, "reading", dict);
+		Py_CLEAR(dict);
+
+		Reading* newReading = new PythonReading(readingDict);
+		Py_CLEAR(readingDict);
+		if (ReadingView::check(item))
+		{
+			// Keep the timestamps of the reading
+			ReadingView::copyTimestamps(item, newReading);
+		}
+
+		trackAsset(newReading->getAssetName());
+		out.push_back(newReading);
+		added++;
+
+		Py_CLEAR(item);
+	}
+	Py_CLEAR(iter);
+
+	if (PyErr_Occurred())
+	{
+		// Error raised by the iterator, i.e. a generator
+		logErrorMessage(codeName, source);
+		// Remove readings added before the error
+		while (added--)
+		{
+			delete out.back();
+			out.pop_back();
+		}
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Add an asset tracking tuple for the given asset name, once
+ *
+ * @param assetName	The asset name of an output reading
+ */
+void SimplePythonFilter::trackAsset(const string& assetName)
+{
+	if (m_trackedAssets.find(assetName) == m_trackedAssets.end())
+	{
+		AssetTracker::getAssetTracker()->addAssetTrackingTuple(this->getConfig().getName(),
+								       assetName,
+								       string("Filter"));
+		m_trackedAssets.insert(assetName);
+	}
+}
+
+/**
+ * Pass a set of readings to the next filter in the pipeline
+ *
+ * The output stream is called from both the ingest and the timer
+ * threads, the calls are serialised. An empty set, such as that of
+ * the release thread when the readings it was to pass on have been
+ * passed by the ingest meanwhile, is deleted rather than passed.
+ *
+ * @param readingSet	The readings to pass onwards
+ */
+void SimplePythonFilter::sendReadings(READINGSET* readingSet)
+{
+	if (((ReadingSet *)readingSet)->getAllReadingsPtr()->empty())
+	{
+		delete (ReadingSet *)readingSet;
+		return;
+	}
+	lock_guard<mutex> guard(m_outputMutex);
+	m_func(m_data, readingSet);
+}
+
+/**
+ * Start the thread that runs the timer code, if not running
+ */
+void SimplePythonFilter::startTimer()
+{
+	lock_guard<mutex> guard(m_timerMutex);
+	if (m_timerRunning)
+	{
+		return;
+	}
+	m_timerRunning = true;
+	m_timerThread = thread(&SimplePythonFilter::timerLoop, this);
+}
+
+/**
+ * Stop the timer thread and wait for it to finish.
+ *
+ * Must not be called with the GIL held as the timer code
+ * execution needs the GIL.
+ */
+void SimplePythonFilter::stopTimer()
+{
+	{
+		lock_guard<mutex> guard(m_timerMutex);
+		if (!m_timerRunning)
+		{
+			return;
+		}
+		m_timerRunning = false;
+	}
+	m_timerCV.notify_all();
+	m_timerThread.join();
+}
+
+/**
+ * Timer thread: run the timer code every m_timerInterval seconds
+ */
+void SimplePythonFilter::timerLoop()
+{
+	unique_lock<mutex> guard(m_timerMutex);
+	while (m_timerRunning)
+	{
+		lock();
+		unsigned int interval = m_timerInterval ? m_timerInterval : 1;
+		unlock();
+		// Wait for the deadline, not just a wakeup, which may be spurious
+		chrono::steady_clock::time_point deadline = chrono::steady_clock::now() +
+							    chrono::seconds(interval);
+		if (m_timerCV.wait_until(guard, deadline, [this]() { return !m_timerRunning; }))
+		{
+			break;
+		}
+
+		guard.unlock();
+		runTimerCode();
+		guard.lock();
+	}
+}
+
+/**
+ * Execute the timer code and send the readings it has added
+ * to the 'readings' list to the next filter
+ */
+void SimplePythonFilter::runTimerCode()
+{
+	lock();
+	bool enabled = isEnabled();
+	unlock();
+	if (!enabled)
+	{
+		return;
+	}
+
+	vector<Reading *> out;
+
+	PyGILState_STATE state = PyGILState_Ensure();
+
+	shared_ptr<CompiledCode> compiled = getCompiled();
+
+	if (compiled && compiled->m_timer)
+	{
+		// Local variables: the 'readings' list to fill
+		PyObject* locals = PyDict_New();
+		PyObject* readings = PyList_New(0);
+		PyDict_SetItemString(locals, "readings", readings);
+		Py_CLEAR(readings);
+
+		lockExecution();
+		PyObject* run = PyEval_EvalCode(compiled->m_timer->getCode(),
+						compiled->m_globals,
+						locals);
+		unlockExecution();
+		if (!run)
+		{
+			logErrorMessage("timer code", compiled->m_timer->getSource());
+		}
+		else
+		{
+			// Borrowed reference: do not remove object
+			PyObject* fanOutReadings = PyDict_GetItemString(locals, "readings");
+			if (fanOutReadings && fanOutReadings != Py_None)
+			{
+				fanOut(NULL, fanOutReadings, out,
+				       "timer code", "readings", compiled->m_timer->getSource());
+			}
+		}
+
+		Py_CLEAR(run);
+		Py_CLEAR(locals);
+
+		// The timer code may change user_data as well
+		checkpoint(compiled.get());
+	}
+
+	compiled.reset();
+
+	PyGILState_Release(state);
+
+	if (out.size())
+	{
+		sendReadings(new ReadingSet(&out));
+	}
+}
+
+/**
+ * Take a checkpoint of the user_data dict of the code, if the
+ * checkpoint interval has elapsed since the last one, and pass it
+ * to the writer thread: only the pickling is done by the caller.
+ *
+ * The caller must hold the GIL and call it between readings, so
+ * that checkpoints are consistent.
+ *
+ * @param compiled	The code whose user_data is saved
+ */
+void SimplePythonFilter::checkpoint(CompiledCode* compiled)
+{
+	lock();
+	unsigned int interval = m_checkpointInterval;
+	unlock();
+
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+	if (!interval || now - m_lastCheckpoint < chrono::seconds(interval))
+	{
+		return;
+	}
+	m_lastCheckpoint = now;
+
+	// Borrowed reference: do not remove object
+	PyObject* userData = PyDict_GetItemString(compiled->m_globals, "user_data");
+	if (!userData)
+	{
+		return;
+	}
+
+	unique_ptr<Checkpoint> snapshot(new Checkpoint(compiled->m_hash));
+	lockExecution();
+	bool taken = snapshot->take(userData);
+	unlockExecution();
+	if (!taken)
+	{
+		// Log the error once, until a checkpoint succeeds
+		if (!m_checkpointFailed)
+		{
+			logErrorMessage("checkpoint", m_checkpointPath);
+		}
+		PyErr_Clear();
+		m_checkpointFailed = true;
+		return;
+	}
+	m_checkpointFailed = false;
+
+	// A checkpoint not yet written is replaced
+	lock_guard<mutex> guard(m_checkpointMutex);
+	m_pendingCheckpoint.swap(snapshot);
+	if (!m_checkpointRunning)
+	{
+		m_checkpointRunning = true;
+		m_checkpointThread = thread(&SimplePythonFilter::checkpointLoop, this);
+	}
+	m_checkpointCV.notify_all();
+}
+
+/**
+ * Checkpoint writer thread: write the checkpoints passed by
+ * checkpoint() until stopped, then the last one, if any
+ */
+void SimplePythonFilter::checkpointLoop()
+{
+	unique_lock<mutex> guard(m_checkpointMutex);
+	while (true)
+	{
+		m_checkpointCV.wait(guard, [this]() {
+			return m_pendingCheckpoint || !m_checkpointRunning;
+		});
+		if (!m_pendingCheckpoint)
+		{
+			break;
+		}
+
+		unique_ptr<Checkpoint> snapshot(m_pendingCheckpoint.release());
+		guard.unlock();
+		writeCheckpoint(*snapshot);
+		guard.lock();
+	}
+}
+
+/**
+ * Write a checkpoint to the checkpoint file of the filter
+ *
+ * @param checkpoint	The checkpoint
+ */
+void SimplePythonFilter::writeCheckpoint(const Checkpoint& checkpoint)
+{
+	if (!checkpoint.write(m_checkpointPath))
+	{
+		Logger::getLogger()->error("Filter '%s': cannot write the checkpoint "
+					   "'%s': %s",
+					   getConfig().getName().c_str(),
+					   m_checkpointPath.c_str(),
+					   strerror(errno));
+	}
+}
+
+/**
+ * Stop the checkpoint writer thread once it has written the
+ * pending checkpoint
+ */
+void SimplePythonFilter::stopCheckpoints()
+{
+	{
+		lock_guard<mutex> guard(m_checkpointMutex);
+		if (!m_checkpointRunning)
+		{
+			return;
+		}
+		m_checkpointRunning = false;
+	}
+	m_checkpointCV.notify_all();
+	m_checkpointThread.join();
+}
+
+/**
+ * Write a last checkpoint of user_data, on shutdown
+ *
+ * Must be called once the ingest and timer threads are stopped
+ * and without the GIL held.
+ */
+void SimplePythonFilter::saveUserData()
+{
+	stopCheckpoints();
+
+	lock();
+	unsigned int interval = m_checkpointInterval;
+	unlock();
+	shared_ptr<CompiledCode> compiled = getCompiled();
+	if (!interval || !compiled)
+	{
+		return;
+	}
+
+	Checkpoint snapshot(compiled->m_hash);
+
+	PyGILState_STATE state = PyGILState_Ensure();
+	// Borrowed reference: do not remove object
+	PyObject* userData = PyDict_GetItemString(compiled->m_globals, "user_data");
+	bool taken = userData && snapshot.take(userData);
+	if (PyErr_Occurred())
+	{
+		logErrorMessage("checkpoint", m_checkpointPath);
+	}
+	compiled.reset();
+	PyGILState_Release(state);
+
+	if (taken)
+	{
+		writeCheckpoint(snapshot);
+	}
+}